@@ -0,0 +1,89 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <vector>
+
+#include "DKohonen.hpp"
+#include "ColourSpaces.hpp"
+#include "imageIO.hpp"
+#include "ColourCache.hpp"
+
+//Buffers of one tile dithering thread, kept for the next image like the rest of the pool
+struct TileBuffers{
+    //Padded error diffusion rows of the tile and its margins
+    std::vector<ColourSpaces::LinRGB> errorRows;
+    //Dithered row of the tile and its margins, of the output's pixel type
+    std::vector<ColourSpaces::RGB> rowOutRgb;
+    std::vector<unsigned char> rowOutPlt;
+    //Training sample of tiles with their own palettes
+    std::vector<ColourSpaces::RGB> sample;
+    ColourCache cache;
+
+    std::vector<ColourSpaces::RGB>& rowOut(const std::vector<ColourSpaces::RGB>&){
+        return rowOutRgb;
+    }
+
+    std::vector<unsigned char>& rowOut(const std::vector<unsigned char>&){
+        return rowOutPlt;
+    }
+};
+
+//Palette a tile trained for itself, converted for dithering and output
+struct TilePalette{
+    DKohonen<ColourSpaces::XYZ> kohonen;
+    std::vector<ColourSpaces::LinRGB> linPalette;
+    std::vector<ColourSpaces::RGB> rgbPalette;
+};
+
+//Every image-sized and row-sized buffer of one ColourCmprs. The pool lives as long as its ColourCmprs
+//and buffers are only resized, never shrunk, so after the first image a run of images no bigger than it allocates nothing.
+//Long-lived owners bound it by replacing a pool grown past their limit with an empty one between images.
+//A buffer's contents are valid from its take() until the next take() of the same buffer
+struct BufferPool{
+    //Decoded source image, from decoding until the end of dithering
+    std::vector<ColourSpaces::RGB> image;
+    //Training sample in training order
+    std::vector<ColourSpaces::RGB> learning;
+    //Pixels already drawn into the training sample
+    std::vector<bool> taken;
+    //Dithered image, as colours in RGB mode and as palette indexes in PLT mode
+    std::vector<ColourSpaces::RGB> ditheredRgb;
+    std::vector<unsigned char> ditheredPlt;
+    //Padded error diffusion rows
+    std::vector<ColourSpaces::LinRGB> errorRows;
+    //Trained palette converted for dithering and output
+    std::vector<ColourSpaces::LinRGB> linPalette;
+    std::vector<ColourSpaces::RGB> rgbPalette;
+    //Row buffers of the PNG reader and writer
+    ImageIO::RowBuffers rows;
+    //One entry per tile dithering thread, grown to the most threads used so far
+    std::vector<TileBuffers> tiles;
+    //One entry per tile with its own palette, grown to the most tiles so far
+    std::vector<TilePalette> tilePalettes;
+
+    template<typename T>
+    static std::vector<T>& take(std::vector<T>& buffer, const size_t& size){
+        buffer.resize(size);
+        return buffer;
+    }
+
+    template<typename T>
+    static size_t held(const std::vector<T>& buffer){
+        return buffer.capacity() * sizeof(T);
+    }
+
+    //Bytes held by the buffers, palettes' networks aside
+    size_t bytes() const {
+        size_t total = held(image) + held(learning) + taken.capacity() / 8 + held(ditheredRgb) + held(ditheredPlt) + held(errorRows)
+            + held(linPalette) + held(rgbPalette) + held(rows.row) + held(rows.prevRow) + held(rows.filtered) + held(rows.pallete);
+        for(const TileBuffers& buffers : tiles){
+            total += held(buffers.errorRows) + held(buffers.rowOutRgb) + held(buffers.rowOutPlt) + held(buffers.sample);
+        }
+        for(const TilePalette& palette : tilePalettes){
+            total += held(palette.linPalette) + held(palette.rgbPalette);
+        }
+        return total;
+    }
+};
+
+#endif
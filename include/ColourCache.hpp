@@ -0,0 +1,91 @@
+#ifndef COLOUR_CACHE_HPP
+#define COLOUR_CACHE_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "ColourSpaces.hpp"
+
+//Direct-mapped cache of nearest colour results, keyed on linear RGB quantised to a given amount of bits per channel.
+//Every key has one slot and a colliding key replaces the one stored there. Not thread safe, every thread keeps its own.
+//Slots are tagged with the epoch they were stored in and reset() starts a new epoch, so emptying the cache does not touch the slots
+class ColourCache{
+private:
+    static const int SLOTS_LOG2 = 14;
+
+    struct Slot{
+        uint64_t key;
+        uint32_t value;
+        uint32_t epoch;
+    };
+
+    int _bits = 0;
+    double _scale = 0;
+    std::vector<Slot> _slots;
+    uint32_t _epoch = 0;
+    size_t _hits = 0;
+    size_t _lookups = 0;
+
+    static size_t _slot(const uint64_t& key){
+        return (key * 0x9E3779B97F4A7C15ull) >> (64 - SLOTS_LOG2);
+    }
+
+public:
+    //Empties the cache. 0 bits disables it, at most 21 bits fit a key
+    void reset(const int& bits){
+        _bits = std::min(std::max(bits, 0), 21);
+        _scale = (double)(((uint64_t)1 << _bits) - 1);
+        _hits = 0;
+        _lookups = 0;
+        if(_bits == 0){
+            return;
+        }
+        _epoch++;
+        //Slots are only cleared when they are made and when the epoch wraps around, epoch 0 marks a cleared slot
+        if(_slots.empty() || (_epoch == 0)){
+            Slot cleared = {0, 0, 0};
+            _slots.assign((size_t)1 << SLOTS_LOG2, cleared);
+            _epoch = 1;
+        }
+    }
+
+    bool enabled() const {
+        return _bits > 0;
+    }
+
+    //Channels are expected in [0; 1]
+    uint64_t key(const ColourSpaces::LinRGB& colour) const {
+        return ((uint64_t)(colour.r * _scale + 0.5) << (2 * _bits))
+            | ((uint64_t)(colour.g * _scale + 0.5) << _bits)
+            | (uint64_t)(colour.b * _scale + 0.5);
+    }
+
+    bool find(const uint64_t& key, size_t& index){
+        _lookups++;
+        const Slot& slot = _slots[_slot(key)];
+        if((slot.epoch != _epoch) || (slot.key != key)){
+            return false;
+        }
+        _hits++;
+        index = slot.value;
+        return true;
+    }
+
+    void store(const uint64_t& key, const size_t& index){
+        Slot& slot = _slots[_slot(key)];
+        slot.key = key;
+        slot.value = index;
+        slot.epoch = _epoch;
+    }
+
+    size_t hits() const {
+        return _hits;
+    }
+
+    size_t lookups() const {
+        return _lookups;
+    }
+};
+
+#endif
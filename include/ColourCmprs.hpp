@@ -1,7 +1,12 @@
+#ifndef COLOUR_CMPRS_HPP
+#define COLOUR_CMPRS_HPP
+
 #include <set>
 #include <math.h>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <sstream>
 
 #include "png.h"
@@ -10,6 +15,10 @@
 #include "DKohonen.hpp"
 #include "ColourSpaces.hpp"
 #include "imageIO.hpp"
+#include "RowQueue.hpp"
+#include "DiffusionKernels.hpp"
+#include "BufferPool.hpp"
+#include "ColourCache.hpp"
 
 class ColourCmprs{
     private:
@@ -20,143 +29,799 @@ uint8_t _percentage = 100;
 double _learningRate = 0;
 std::mt19937 _randEng = std::mt19937(std::chrono::high_resolution_clock::now().time_since_epoch().count());
 DKohonen<ColourSpaces::XYZ> _colourKohonen;
+//Buffers reused by every process() call
+BufferPool _buffers;
+//Palette given from outside, training is skipped while it is set
+std::vector<ColourSpaces::XYZ> _presetPalette;
+//Pipelined mode overlaps decoding with training and dithering with encoding
+bool _pipelined = false;
+//Diffusion kernel chosen by the user and the one in use, which the time budget may narrow
+DiffusionKernels::Kernel _kernel = DiffusionKernels::JarvisJudiceNinke;
+DiffusionKernels::Kernel _activeKernel = DiffusionKernels::JarvisJudiceNinke;
+//Nearest colour search seeded from the previous pixel's colour (Orchard's algorithm) instead of a full palette scan.
+//Chosen by the user and in use, the time budget may turn it on
+bool _seededSearch = false;
+bool _activeSeededSearch = false;
+size_t _rowQueueCapacity = 64;
+size_t _shuffleBufferSize = 4096;
+//Tiled dithering. Tiles of _tileSize pixels are dithered in parallel, 0 dithers the whole image in one pass.
+//Every tile first dithers _tileMargin pixels around itself, so the error entering it across its borders is already built up
+size_t _tileSize = 0;
+int _tileMargin = 16;
+//Tiles train their own palettes and the image is written in RGB mode
+bool _localPalettes = false;
+//Palette as dithering uses it: the network to search and its colours for diffusion and output
+struct PaletteRef{
+    DKohonen<ColourSpaces::XYZ>* kohonen;
+    const std::vector<ColourSpaces::LinRGB>* linPalette;
+    const std::vector<ColourSpaces::RGB>* rgbPalette;
+};
+//Part of its learning portion every tile trains on, the time budget may lower it
+double _tileSampleShare = 1.0;
+//Nearest colour results are memoised by linear RGB quantised to _cacheBits bits per channel, 0 disables the cache
+int _cacheBits = 0;
+ColourCache _colourCache;
+size_t _cacheHits = 0;
+size_t _cacheLookups = 0;
+
+//Latency budget. 0 means unlimited, otherwise the run adapts its stages to finish within it
+size_t _timeBudget = 0;
+std::chrono::time_point<std::chrono::high_resolution_clock> _deadline;
+std::vector<std::string> _degradations;
+bool _fastSearch = false;
+bool _diffusion = true;
+int _compressionLevel = Z_BEST_COMPRESSION;
+//Calibrated kernel timings in nanoseconds
+double _preciseMetricCost = 0;
+double _fastMetricCost = 0;
+double _conversionCost = 0;
+double _encodeCostBest = 0;
+double _encodeCostFast = 0;
 
-double _clampLinRGB(const double& val){
-    return std::min(std::max(0.0, val), 1.0);
+static double _preciseMetric(const ColourSpaces::XYZ& xyz1, const ColourSpaces::XYZ& xyz2){
+    return ColourSpaces::CIEDE2000(xyz1.toLAB(), xyz2.toLAB());
 }
 
-ColourSpaces::LinRGB _propogateDithErrorLIN(ColourSpaces::LinRGB pixel, const double& errR, const double& errG, const double& errB, const double& coeff){
-    pixel.r = _clampLinRGB(pixel.r + errR * coeff);
-    pixel.g = _clampLinRGB(pixel.g + errG * coeff);
-    pixel.b = _clampLinRGB(pixel.b + errB * coeff);
-    return pixel;
+static double _fastMetric(const ColourSpaces::XYZ& xyz1, const ColourSpaces::XYZ& xyz2){
+    return ColourSpaces::CIE76(xyz1.toLAB(), xyz2.toLAB());
 }
 
-void _ditheringBodyLIN(
-    std::vector<ColourSpaces::LinRGB>& imgData, 
-    const int& width, 
-    const int& height, 
-    const int& x, 
-    const int& y, 
-    const ColourSpaces::LinRGB& oldColour, 
-    const ColourSpaces::LinRGB& newColour,
-    const char& step){
-    double errR = oldColour.r - newColour.r;
-    double errG = oldColour.g - newColour.g;
-    double errB = oldColour.b - newColour.b;
-    if((0 <= (x + step)) && ((x + step) < width)){
-        size_t newLoc = y * width + x + step;
-        imgData[newLoc] = _propogateDithErrorLIN(imgData[newLoc], errR, errG, errB, 7.0/48.0);
-        if((0 <= (x + 2 * step)) && ((x + 2 * step) < width)){
-            newLoc = y * width + x + 2 * step;
-            imgData[newLoc] = _propogateDithErrorLIN(imgData[newLoc], errR, errG, errB, 5.0/48.0);
-        }
-    }
-    if(y + 1 < height){
-        size_t newLoc = (y + 1) * width + x;
-        imgData[newLoc] = _propogateDithErrorLIN(imgData[newLoc], errR, errG, errB, 7.0/48.0);
-        if(x - 1 >= 0){
-            imgData[newLoc - 1] = _propogateDithErrorLIN(imgData[newLoc - 1], errR, errG, errB, 5.0/48.0);
-            if(x - 2 >= 0){
-                imgData[newLoc - 2] = _propogateDithErrorLIN(imgData[newLoc - 2], errR, errG, errB, 3.0/48.0);
-            }
+static bool _sameRGB(const ColourSpaces::RGB& rgb1, const ColourSpaces::RGB& rgb2){
+    return (rgb1.r == rgb2.r) && (rgb1.g == rgb2.g) && (rgb1.b == rgb2.b);
+}
+
+double _remainingNs() const {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(_deadline - std::chrono::high_resolution_clock::now()).count();
+}
+
+double _metricCost(double (*metric)(const ColourSpaces::XYZ&, const ColourSpaces::XYZ&)){
+    std::uniform_real_distribution<double> channel(0.0, 1.0);
+    std::vector<ColourSpaces::XYZ> samples;
+    for(int i = 0; i < 64; i++){
+        samples.push_back(ColourSpaces::LinRGB(channel(_randEng), channel(_randEng), channel(_randEng)).toXYZ());
+    }
+    volatile double sink = 0;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < 4096; i++){
+        sink = sink + metric(samples[i % 64], samples[(i * 7 + 1) % 64]);
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> stop = std::chrono::high_resolution_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / 4096;
+}
+
+double _encodeCost(const std::vector<unsigned char>& sample, const int& level){
+    uLongf compressedSize = compressBound(sample.size());
+    std::vector<Bytef> compressed(compressedSize);
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    compress2(compressed.data(), &compressedSize, sample.data(), sample.size(), level);
+    std::chrono::time_point<std::chrono::high_resolution_clock> stop = std::chrono::high_resolution_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() * 3 / sample.size();
+}
+
+//Times the kernels every stage is built of: metric evaluations, per pixel conversions and zlib on a slice of the image
+void _calibrate(const ColourSpaces::RGB* rgbData, const size_t& sampleSize){
+    _preciseMetricCost = _metricCost(&ColourCmprs::_preciseMetric);
+    _fastMetricCost = _metricCost(&ColourCmprs::_fastMetric);
+    size_t samplePixels = std::min(sampleSize, (size_t)16384);
+    std::vector<unsigned char> sample;
+    sample.reserve(samplePixels * 3);
+    volatile double sink = 0;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < samplePixels; i++){
+        sink = sink + rgbData[i].toLinRGB().toXYZ().y;
+        sample.push_back(rgbData[i].r);
+        sample.push_back(rgbData[i].g);
+        sample.push_back(rgbData[i].b);
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> stop = std::chrono::high_resolution_clock::now();
+    _conversionCost = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / std::max(samplePixels, (size_t)1);
+    if(sample.empty()){
+        return;
+    }
+    _encodeCostBest = _encodeCost(sample, Z_BEST_COMPRESSION);
+    _encodeCostFast = _encodeCost(sample, Z_BEST_SPEED);
+}
+
+//Tiles train their own palettes unless a preset palette is used
+bool _localTiles() const {
+    return (_tileSize > 0) && _localPalettes && _presetPalette.empty();
+}
+
+//Tiles bigger than the image are clamped so tile bounds stay within int
+int _tileSide(const int& width, const int& height) const {
+    return std::min(_tileSize, (size_t)std::max(std::max(width, height), 1));
+}
+
+size_t _tilesX(const int& width, const int& height) const {
+    return (width + _tileSide(width, height) - 1) / _tileSide(width, height);
+}
+
+size_t _tilesY(const int& width, const int& height) const {
+    return (height + _tileSide(width, height) - 1) / _tileSide(width, height);
+}
+
+size_t _tileCount(const int& width, const int& height) const {
+    return _tilesX(width, height) * _tilesY(width, height);
+}
+
+//Threads dithering runs on: one, or as many as there are cores and tiles in tiled mode
+double _ditheringThreads(const int& width, const int& height) const {
+    if(_tileSize == 0){
+        return 1;
+    }
+    return std::max(std::min((double)std::thread::hardware_concurrency(), (double)_tileCount(width, height)), 1.0);
+}
+
+double _ditheringEstimate(const int& width, const int& height, const size_t& paletteSize) const {
+    size_t pixels = (size_t)width * height;
+    double metricCost = (_fastSearch)?(_fastMetricCost):(_preciseMetricCost);
+    double searchCost = paletteSize * metricCost;
+    double tableCost = 0;
+    if(_activeSeededSearch){
+        //Seeded search was measured to take about 2 + 1.5 * log2(palette size) metric evaluations per pixel
+        searchCost = std::min((double)paletteSize, 2.0 + 1.5 * log2(std::max(paletteSize, (size_t)1))) * metricCost;
+        tableCost = paletteSize * paletteSize / 2.0 * metricCost;
+    }
+    double encodeCost = (_compressionLevel == Z_BEST_SPEED)?(_encodeCostFast):(_encodeCostBest);
+    //Linearisation and conversion, then diffusion taps, 12 of which cost about as much as the conversion
+    double pixelCost = (_diffusion)?(_conversionCost * (1.0 + DiffusionKernels::tapCount(_activeKernel) / 12.0)):(0);
+    double threads = _ditheringThreads(width, height);
+    double overlap = 1;
+    if((_tileSize > 0) && (pixels > 0)){
+        //Margins are dithered by every tile next to them: on both sides of a column border, above a row border
+        int margin = (_diffusion)?(_tileMargin):(0);
+        overlap = (width + 2.0 * margin * (_tilesX(width, height) - 1)) * (height + (double)margin * (_tilesY(width, height) - 1)) / pixels;
+    }
+    if(_localTiles()){
+        tableCost *= _tileCount(width, height) / threads;
+    }
+    return tableCost + pixels * (overlap * (searchCost + pixelCost) / threads + encodeCost);
+}
+
+//Applies degradations in order of their quality cost until dithering and encoding fit into available nanoseconds
+void _fitToBudget(const int& width, const int& height, const size_t& paletteSize, const double& available){
+    if(!_activeSeededSearch && (_ditheringEstimate(width, height, paletteSize) > available)){
+        _activeSeededSearch = true;
+        _degradations.push_back("nearest colour search seeded from the previous pixel's colour");
+    }
+    if(!_fastSearch && (_ditheringEstimate(width, height, paletteSize) > available)){
+        _fastSearch = true;
+        _degradations.push_back("nearest colour search switched from CIEDE2000 to CIE76");
+    }
+    if((_compressionLevel != Z_BEST_SPEED) && (_ditheringEstimate(width, height, paletteSize) > available)){
+        _compressionLevel = Z_BEST_SPEED;
+        _degradations.push_back("PNG compression level lowered to fastest");
+    }
+    if(_diffusion && (_activeKernel != DiffusionKernels::FloydSteinberg) && (_ditheringEstimate(width, height, paletteSize) > available)){
+        _activeKernel = DiffusionKernels::FloydSteinberg;
+        _degradations.push_back("diffusion kernel narrowed to Floyd-Steinberg");
+    }
+    if(_diffusion && (_ditheringEstimate(width, height, paletteSize) > available)){
+        _diffusion = false;
+        _degradations.push_back("error diffusion disabled, pixels mapped to nearest colour");
+    }
+}
+
+//Share of pixels farther than maxDiff from every colour of a stand-in palette of paletteSize sampled pixels.
+//Once the network is full such a pixel makes it scan every pair of nodes for one to merge
+double _farShare(const ColourSpaces::RGB* sample, const size_t& sampleSize, const size_t& paletteSize, const double& maxDiff){
+    size_t probes = std::max((size_t)8192 / std::max(paletteSize, (size_t)1), (size_t)4);
+    size_t stride = sampleSize / (paletteSize + probes);
+    if(stride == 0){
+        return 1;
+    }
+    std::vector<ColourSpaces::XYZ> palette;
+    for(size_t i = 0; i < paletteSize; i++){
+        palette.push_back(sample[i * stride].toLinRGB().toXYZ());
+    }
+    size_t far = 0;
+    for(size_t i = paletteSize; i < paletteSize + probes; i++){
+        ColourSpaces::XYZ probe = sample[i * stride].toLinRGB().toXYZ();
+        double minDist = std::numeric_limits<double>::max();
+        for(size_t j = 0; (j < palette.size()) && (minDist > maxDiff); j++){
+            minDist = std::min(minDist, _preciseMetric(probe, palette[j]));
+        }
+        far += (minDist > maxDiff)?(1):(0);
+    }
+    return (double)far / probes;
+}
+
+//Splits what is left of the budget between training and the later stages, shrinking toProcess to what training can afford
+std::chrono::time_point<std::chrono::high_resolution_clock> _planTraining(const ColourSpaces::RGB* sample, const size_t& sampleSize, const int& width, const int& height, size_t& toProcess){
+    if(_timeBudget == 0){
+        return _deadline;
+    }
+    size_t wanted = toProcess;
+    _calibrate(sample, sampleSize);
+    size_t paletteEstimate = (_presetPalette.empty())?(std::max(std::min(_numMaxColours, toProcess), (size_t)1)):(_presetPalette.size());
+    //Local palettes fill up once per tile
+    double fillSteps = paletteEstimate * ((_localTiles())?(_tileCount(width, height)):(1));
+    double farShare = (toProcess > fillSteps)?(_farShare(sample, sampleSize, paletteEstimate, 119.475 * _maxDiffPercent / 100.0)):(0);
+    double remaining = _remainingNs();
+    //Training keeps at least a quarter of what is left, dithering and encoding get the rest
+    _fitToBudget(width, height, paletteEstimate, remaining * 0.75);
+    double trainingShare = std::max(remaining - _ditheringEstimate(width, height, paletteEstimate), remaining * 0.1);
+    //Local palettes are trained by the tile threads
+    double trainingThreads = (_localTiles())?(_ditheringThreads(width, height)):(1);
+    double trainingNs = trainingShare * trainingThreads;
+    //Every step searches the nearest node, steps on a full network also scan node pairs for far pixels
+    double searchCost = paletteEstimate * _preciseMetricCost;
+    double fullStepCost = searchCost + farShare * paletteEstimate * (paletteEstimate - 1) / 2.0 * _preciseMetricCost;
+    double affordableSteps = trainingNs / searchCost;
+    if(affordableSteps > fillSteps){
+        affordableSteps = fillSteps + (trainingNs - fillSteps * searchCost) / fullStepCost;
+    }
+    size_t affordable = std::max(affordableSteps, 1.0);
+    if(affordable < toProcess){
+        std::stringstream degradation;
+        degradation << "training sample reduced from " << toProcess << " to " << affordable << " pixels";
+        _degradations.push_back(degradation.str());
+        toProcess = affordable;
+    }
+    _tileSampleShare = (double)toProcess / std::max(wanted, (size_t)1);
+    return std::chrono::high_resolution_clock::now() + std::chrono::nanoseconds((long long)trainingShare);
+}
+
+//Draws amount pixels without replacement straight into the learning buffer (Floyd's algorithm, one random draw per sampled pixel)
+//and shuffles them, so training does not see them in scan order
+std::vector<ColourSpaces::RGB>& _sampleLearningData(const std::vector<ColourSpaces::RGB>& rgbData, const size_t& amount){
+    std::vector<ColourSpaces::RGB>& sample = _buffers.learning;
+    std::vector<bool>& taken = _buffers.taken;
+    sample.clear();
+    taken.assign(rgbData.size(), false);
+    for(size_t j = rgbData.size() - std::min(amount, rgbData.size()); j < rgbData.size(); j++){
+        size_t pixel = std::uniform_int_distribution<size_t>(0, j)(_randEng);
+        if(taken[pixel]){
+            pixel = j;
+        }
+        taken[pixel] = true;
+        sample.push_back(rgbData[pixel]);
+    }
+    std::shuffle(sample.begin(), sample.end(), _randEng);
+    return sample;
+}
+
+//Trains on the i-th sampled pixel. Returns false once the training deadline has passed
+bool _trainPixel(
+    const ColourSpaces::RGB& pixel, 
+    const size_t& i, 
+    const size_t& toProcess, 
+    const std::chrono::time_point<std::chrono::high_resolution_clock>& trainingDeadline, 
+    const double& maxDiff, 
+    const double& minDiff){
+    //A step can scan every pair of nodes, so the clock is read before each one
+    if((_timeBudget > 0) && (i > 0) && (std::chrono::high_resolution_clock::now() > trainingDeadline)){
+        std::stringstream degradation;
+        degradation << "training stopped at its deadline after " << i << " of " << toProcess << " pixels";
+        _degradations.push_back(degradation.str());
+        return false;
+    }
+    _colourKohonen.trainStep(pixel.toLinRGB().toXYZ(), _numMaxColours, maxDiff, minDiff, _learningRate);
+    return true;
+}
+
+void _decodeThread(ImageIO::RowReader& reader, std::vector<ColourSpaces::RGB>& rgbData, RowQueue<int>& decodedRows, std::exception_ptr& error){
+    try{
+        for(int y = 0; y < reader.height(); y++){
+            reader.readRow(&rgbData[(size_t)y * reader.width()]);
+            decodedRows.push(y);
         }
-        if(x + 1 < width){
-            imgData[newLoc + 1] = _propogateDithErrorLIN(imgData[newLoc + 1], errR, errG, errB, 5.0/48.0);
-            if(x + 2 < width){
-                imgData[newLoc + 2] = _propogateDithErrorLIN(imgData[newLoc + 2], errR, errG, errB, 3.0/48.0);
+    }
+    catch(...){
+        error = std::current_exception();
+    }
+    decodedRows.close();
+}
+
+//Trains on rows as the decoder hands them over. Pixels are sampled with the learning portion as probability
+//and pass through a bounded shuffle buffer, so the network does not see them in scan order. Returns amount of sampled pixels
+size_t _trainPipelined(const std::vector<ColourSpaces::RGB>& rgbData, const int& width, RowQueue<int>& decodedRows, const double& maxDiff, const double& minDiff){
+    size_t toProcess = (_presetPalette.empty())?(rgbData.size() * _percentage / 100.0):(0);
+    std::chrono::time_point<std::chrono::high_resolution_clock> trainingDeadline = _deadline;
+    std::bernoulli_distribution sampled((double)_percentage / 100.0);
+    std::vector<ColourSpaces::RGB>& shuffleBuffer = _buffers.learning;
+    shuffleBuffer.clear();
+    size_t trained = 0;
+    bool training = _presetPalette.empty();
+    int y = 0;
+    while(decodedRows.pop(y)){
+        const ColourSpaces::RGB* row = &rgbData[(size_t)y * width];
+        //Budgets are planned on the first row even when nothing is trained, later stages rely on the calibration
+        if(y == 0){
+            trainingDeadline = _planTraining(row, width, width, rgbData.size() / width, toProcess);
+            sampled = std::bernoulli_distribution((double)toProcess / rgbData.size());
+            if(_localTiles()){
+                training = false;
             }
         }
-        if(y + 2 < height){
-            newLoc = (y + 2) * width + x;
-            imgData[newLoc] = _propogateDithErrorLIN(imgData[newLoc], errR, errG, errB, 5.0/48.0);
-            if(x - 1 >= 0){
-                imgData[newLoc - 1] = _propogateDithErrorLIN(imgData[newLoc - 1], errR, errG, errB, 3.0/48.0);
-                if(x - 2 >= 0){
-                    imgData[newLoc - 2] = _propogateDithErrorLIN(imgData[newLoc - 2], errR, errG, errB, 1.0/48.0);
-                }
+        if(!training){
+            continue;
+        }
+        for(int x = 0; (x < width) && training; x++){
+            if(!sampled(_randEng)){
+                continue;
             }
-            if(x + 1 < width){
-                imgData[newLoc + 1] = _propogateDithErrorLIN(imgData[newLoc + 1], errR, errG, errB, 3.0/48.0);
-                if(x + 2 < width){
-                    imgData[newLoc + 2] = _propogateDithErrorLIN(imgData[newLoc + 2], errR, errG, errB, 1.0/48.0);
-                }
+            if(shuffleBuffer.size() < _shuffleBufferSize){
+                shuffleBuffer.push_back(row[x]);
+                continue;
             }
+            size_t slot = std::uniform_int_distribution<size_t>(0, shuffleBuffer.size() - 1)(_randEng);
+            training = _trainPixel(shuffleBuffer[slot], trained++, toProcess, trainingDeadline, maxDiff, minDiff);
+            shuffleBuffer[slot] = row[x];
+        }
+    }
+    std::shuffle(shuffleBuffer.begin(), shuffleBuffer.end(), _randEng);
+    for(size_t i = 0; training && (i < shuffleBuffer.size()); i++){
+        training = _trainPixel(shuffleBuffer[i], trained++, toProcess, trainingDeadline, maxDiff, minDiff);
+    }
+    //Sampling may miss every pixel of a small sample. A sample of 0 pixels is left untrained, as in sequential mode
+    if(_presetPalette.empty() && !_localTiles() && (trained == 0) && (toProcess > 0)){
+        _colourKohonen.trainStep(rgbData[0].toLinRGB().toXYZ(), _numMaxColours, maxDiff, minDiff, _learningRate);
+        trained++;
+    }
+    return trained;
+}
+
+template<typename Pixel, typename Writer>
+void _encodeThread(Writer& writer, const std::vector<Pixel>& dithered, const int& width, RowQueue<int>& ditheredRows, std::exception_ptr& error){
+    try{
+        int y = 0;
+        while(ditheredRows.pop(y)){
+            writer.writeRow(&dithered[(size_t)y * width]);
         }
+        writer.finish();
+    }
+    catch(...){
+        error = std::current_exception();
+        ditheredRows.close();
+    }
+}
+
+//Dithers on this thread while the encoder thread writes every row as soon as it is final
+template<typename Pixel, typename Writer>
+void _ditherAndEncode(
+    Writer& writer, 
+    const std::vector<ColourSpaces::RGB>& rgbData, 
+    std::vector<Pixel>& dithered, 
+    const int& width, 
+    const int& height, 
+    void (ColourCmprs::*dither)(const std::vector<ColourSpaces::RGB>&, const int&, const int&, std::vector<Pixel>&, RowQueue<int>*)){
+    RowQueue<int> ditheredRows(_rowQueueCapacity);
+    std::exception_ptr encodeError;
+    std::thread encoder(&ColourCmprs::_encodeThread<Pixel, Writer>, this, std::ref(writer), std::cref(dithered), width, std::ref(ditheredRows), std::ref(encodeError));
+    try{
+        (this->*dither)(rgbData, width, height, dithered, &ditheredRows);
+    }
+    catch(...){
+        ditheredRows.close();
+        encoder.join();
+        throw;
+    }
+    ditheredRows.close();
+    encoder.join();
+    if(encodeError){
+        std::rethrow_exception(encodeError);
     }
 }
 
-void _ditherDataPrepThread(const std::vector<ColourSpaces::RGB>& imgData, int y, const int& width, std::vector<ColourSpaces::LinRGB>& errorBuffer){
+ColourSpaces::LinRGB _clampLinRGB(const ColourSpaces::LinRGB& pixel){
+    return ColourSpaces::LinRGB(
+        std::min(std::max(0.0, pixel.r), 1.0),
+        std::min(std::max(0.0, pixel.g), 1.0),
+        std::min(std::max(0.0, pixel.b), 1.0)
+    );
+}
+
+void _linearizeRow(const ColourSpaces::RGB* src, const int& width, ColourSpaces::LinRGB* errorRow){
     for(int x = 0; x < width; x++){
-        errorBuffer.push_back(imgData[y*width + x].toLinRGB());
+        errorRow[x] = src[x].toLinRGB();
     }
 }
 
-std::vector<ColourSpaces::RGB> _applyDithering(const std::vector<ColourSpaces::RGB>& imgData, const int& width, const int& height){
-    std::vector<ColourSpaces::RGB> newImgData = imgData;
-    std::vector<ColourSpaces::LinRGB> errorBuffer = std::vector<ColourSpaces::LinRGB>();
-    errorBuffer.reserve(width*4);
-    for(int i = 0; i < width * 3; i++){
-        errorBuffer.push_back(imgData[i].toLinRGB());
+//The previous pixel's colour seeds the search, neighbouring pixels mostly map to the same or a close palette entry
+size_t _closestColourInd(DKohonen<ColourSpaces::XYZ>& kohonen, const ColourSpaces::XYZ& colour, const size_t& previousIndex){
+    if(_activeSeededSearch){
+        return kohonen.closestGroupIndFrom(colour, previousIndex);
     }
-    int lineStart = 0;
-    int lineStop = width;
-    char step = 1;
-    std::thread linearizer;
-    for(int y = 0; y < height; y++){
-        if(y + 3 < height){
-            linearizer = std::thread(&ColourCmprs::_ditherDataPrepThread, this, std::cref(imgData), y + 3, std::cref(width), std::ref(errorBuffer));
+    return kohonen.closestGroupInd(colour);
+}
+
+//Cache hits skip the conversion to XYZ and the palette search
+size_t _cachedColourInd(DKohonen<ColourSpaces::XYZ>& kohonen, ColourCache& cache, const ColourSpaces::LinRGB& colour, const size_t& previousIndex){
+    if(!cache.enabled()){
+        return _closestColourInd(kohonen, colour.toXYZ(), previousIndex);
+    }
+    uint64_t key = cache.key(colour);
+    size_t colourIndex = 0;
+    if(!cache.find(key, colourIndex)){
+        colourIndex = _closestColourInd(kohonen, colour.toXYZ(), previousIndex);
+        cache.store(key, colourIndex);
+    }
+    return colourIndex;
+}
+
+void _addCacheStats(const ColourCache& cache){
+    _cacheHits += cache.hits();
+    _cacheLookups += cache.lookups();
+}
+
+//Dithered pixel is stored as palette index in PLT mode and as the colour itself in RGB mode
+void _store(unsigned char& out, const size_t& colourIndex, const std::vector<ColourSpaces::RGB>&){
+    out = colourIndex;
+}
+
+void _store(ColourSpaces::RGB& out, const size_t& colourIndex, const std::vector<ColourSpaces::RGB>& rgbPalette){
+    out = rgbPalette[colourIndex];
+}
+
+//Accumulated error is clamped once when the pixel is read instead of on every tap
+template<DiffusionKernels::Kernel K, int S, typename Pixel>
+void _ditherRow(
+    DKohonen<ColourSpaces::XYZ>& kohonen, 
+    ColourCache& cache, 
+    ColourSpaces::LinRGB* const* rows, 
+    const int& width, 
+    Pixel* out, 
+    const std::vector<ColourSpaces::LinRGB>& linPalette, 
+    const std::vector<ColourSpaces::RGB>& rgbPalette, 
+    size_t& colourIndex){
+    for(int x = (S == 1)?(0):(width - 1); x != ((S == 1)?(width):(-1)); x += S){
+        ColourSpaces::LinRGB oldColour = _clampLinRGB(rows[0][x]);
+        colourIndex = _cachedColourInd(kohonen, cache, oldColour, colourIndex);
+        const ColourSpaces::LinRGB& newColour = linPalette[colourIndex];
+        DiffusionKernels::Taps<K>::template diffuse<S>(rows, x, ColourSpaces::LinRGB(oldColour.r - newColour.r, oldColour.g - newColour.g, oldColour.b - newColour.b));
+        _store(out[x], colourIndex, rgbPalette);
+    }
+}
+
+//Nearest colour mapping without diffusion. Runs of equal source pixels reuse the previous result
+template<typename Pixel>
+void _mapRow(DKohonen<ColourSpaces::XYZ>& kohonen, ColourCache& cache, const ColourSpaces::RGB* src, const ColourSpaces::LinRGB* row, const int& width, Pixel* out, const std::vector<ColourSpaces::RGB>& rgbPalette, size_t& colourIndex){
+    for(int x = 0; x < width; x++){
+        if((x == 0) || !_sameRGB(src[x], src[x - 1])){
+            colourIndex = _cachedColourInd(kohonen, cache, row[x], colourIndex);
         }
-        for(int x = lineStart; x != lineStop; x += step){
-            size_t loc = y * width + x;
-            const ColourSpaces::LinRGB& oldColour = errorBuffer[x];
-            ColourSpaces::LinRGB newColour = _colourKohonen.getClosestGroup(oldColour.toXYZ()).toLinRGB();
-            _ditheringBodyLIN(errorBuffer, width, ((y + 2) < height)?(3):(height - y), x, 0, oldColour, newColour, step);
-            newImgData[loc] = newColour.toRGB();
+        _store(out[x], colourIndex, rgbPalette);
+    }
+}
+
+//Trains a tile's own palette on a sample of the tile together with its margins, which neighbouring tiles share
+void _trainTile(
+    DKohonen<ColourSpaces::XYZ>& kohonen, 
+    const std::vector<ColourSpaces::RGB>& imgData, 
+    const int& width, 
+    const int& left, 
+    const int& top, 
+    const int& right, 
+    const int& bottom, 
+    const double& maxDiff, 
+    const double& minDiff, 
+    std::mt19937& randEng, 
+    std::vector<ColourSpaces::RGB>& sample){
+    sample.clear();
+    for(int y = top; y < bottom; y++){
+        sample.insert(sample.end(), imgData.begin() + (size_t)y * width + left, imgData.begin() + (size_t)y * width + right);
+    }
+    size_t toProcess = std::min(std::max(sample.size() * _percentage / 100.0 * _tileSampleShare, 1.0), (double)sample.size());
+    for(size_t i = 0; i < toProcess; i++){
+        std::swap(sample[i], sample[std::uniform_int_distribution<size_t>(i, sample.size() - 1)(randEng)]);
+        kohonen.trainStep(sample[i].toLinRGB().toXYZ(), _numMaxColours, maxDiff, minDiff, _learningRate);
+    }
+}
+
+//Dithers the part [start, end) of a row with one palette. Parts are taken in scan direction, so error crossing
+//into the next part lands in pixels not yet dithered
+template<DiffusionKernels::Kernel K, int S, typename Pixel>
+void _ditherPart(const PaletteRef& palette, ColourCache& cache, ColourSpaces::LinRGB* const* rows, const int& start, const int& end, Pixel* out, size_t& colourIndex){
+    if(start == end){
+        return;
+    }
+    ColourSpaces::LinRGB* partRows[3] = {rows[0] + start, rows[1] + start, rows[2] + start};
+    _ditherRow<K, S>(*palette.kohonen, cache, partRows, end - start, out + start, *palette.linPalette, *palette.rgbPalette, colourIndex);
+}
+
+//Dithers the tile [x0, x1) x [y0, y1) into out. Its rows start _tileMargin rows above the tile and reach _tileMargin pixels
+//to both sides, but only pixels inside the tile are stored. Scan direction follows the image row as in the untiled pass.
+//Margins are dithered with the palettes of the tiles they belong to, so the error they carry into the tile is the one
+//those tiles really leave: palettes[0] are the tiles above, palettes[1] this tile's row, both left to right.
+//Only the tile's own palette, palettes[1][1], goes through the cache
+template<DiffusionKernels::Kernel K, typename Pixel>
+void _ditherTile(
+    const PaletteRef (&palettes)[2][3], 
+    const std::vector<ColourSpaces::RGB>& imgData, 
+    const int& width, 
+    const int& x0, 
+    const int& y0, 
+    const int& x1, 
+    const int& y1, 
+    ColourCache& cache, 
+    std::vector<ColourSpaces::LinRGB>& errorRows, 
+    std::vector<Pixel>& rowOut, 
+    std::vector<Pixel>& out){
+    int margin = (_diffusion)?(_tileMargin):(0);
+    int left = std::max(x0 - margin, 0);
+    int right = std::min(x1 + margin, width);
+    int top = std::max(y0 - margin, 0);
+    int regionWidth = right - left;
+    int bounds[4] = {0, x0 - left, x1 - left, regionWidth};
+    size_t stride = regionWidth + 2 * DiffusionKernels::PADDING;
+    BufferPool::take(errorRows, 4 * stride);
+    BufferPool::take(rowOut, regionWidth);
+    ColourCache uncached;
+    //3 rows in use and a discarded fourth one for rows below the tile
+    ColourSpaces::LinRGB* ring[4];
+    for(int slot = 0; slot < 4; slot++){
+        ring[slot] = &errorRows[slot * stride + DiffusionKernels::PADDING];
+    }
+    for(int y = top; y < std::min(top + 2, y1); y++){
+        _linearizeRow(&imgData[(size_t)y * width + left], regionWidth, ring[(y - top) % 3]);
+    }
+    size_t colourIndex = 0;
+    for(int y = top; y < y1; y++){
+        if(y + 2 < y1){
+            _linearizeRow(&imgData[(size_t)(y + 2) * width + left], regionWidth, ring[(y + 2 - top) % 3]);
         }
-        if(y + 3 < height){
-            linearizer.join();
+        ColourSpaces::LinRGB* rows[3] = {
+            ring[(y - top) % 3],
+            (y + 1 < y1)?(ring[(y + 1 - top) % 3]):(ring[3]),
+            (y + 2 < y1)?(ring[(y + 2 - top) % 3]):(ring[3])
+        };
+        const PaletteRef* rowPalettes = palettes[(y < y0)?(0):(1)];
+        if(!_diffusion){
+            _mapRow(*rowPalettes[1].kohonen, cache, &imgData[(size_t)y * width + left], rows[0], regionWidth, rowOut.data(), *rowPalettes[1].rgbPalette, colourIndex);
         }
-        step = -step;
-        lineStart = (lineStart == 0)?(width - 1):(0);
-        lineStop = (lineStop == width)?(-1):(width);
-        errorBuffer.erase(errorBuffer.begin(), errorBuffer.begin() + width);
+        else if(y % 2 == 0){
+            for(int part = 0; part < 3; part++){
+                ColourCache& partCache = (rowPalettes[part].kohonen == palettes[1][1].kohonen)?(cache):(uncached);
+                _ditherPart<K, 1>(rowPalettes[part], partCache, rows, bounds[part], bounds[part + 1], rowOut.data(), colourIndex);
+            }
+        }
+        else{
+            for(int part = 2; part >= 0; part--){
+                ColourCache& partCache = (rowPalettes[part].kohonen == palettes[1][1].kohonen)?(cache):(uncached);
+                _ditherPart<K, -1>(rowPalettes[part], partCache, rows, bounds[part], bounds[part + 1], rowOut.data(), colourIndex);
+            }
+        }
+        if(y >= y0){
+            std::copy(rowOut.begin() + (x0 - left), rowOut.begin() + (x1 - left), out.begin() + (size_t)y * width + x0);
+        }
+    }
+}
+
+//Trains the palette of a tile with its own palette. Called once per tile, by whichever tile needs it first
+void _trainTilePalette(
+    TilePalette& palette, 
+    const std::vector<ColourSpaces::RGB>& imgData, 
+    const int& width, 
+    const int& height, 
+    const int& x0, 
+    const int& y0, 
+    const unsigned int& seed, 
+    std::vector<ColourSpaces::RGB>& sample){
+    int tileSize = _tileSide(width, height);
+    int x1 = std::min(x0 + tileSize, width);
+    int y1 = std::min(y0 + tileSize, height);
+    palette.kohonen = DKohonen<ColourSpaces::XYZ>(&ColourCmprs::_preciseMetric);
+    std::mt19937 randEng(seed);
+    _trainTile(
+        palette.kohonen, imgData, width, 
+        std::max(x0 - _tileMargin, 0), std::max(y0 - _tileMargin, 0), std::min(x1 + _tileMargin, width), std::min(y1 + _tileMargin, height), 
+        119.475 * _maxDiffPercent / 100.0, 119.475 * _minDiffPercent / 100.0, randEng, sample);
+    if(_fastSearch){
+        palette.kohonen.setMetric(&ColourCmprs::_fastMetric);
+    }
+    if(_activeSeededSearch){
+        palette.kohonen.buildNeighbourTable();
+    }
+    _convertPalette(palette.kohonen.groups(), palette.linPalette, palette.rgbPalette);
+}
+
+//Tiles are taken in scan order by a pool of threads. A band of tiles is handed to the encoder once all of its tiles are done
+template<DiffusionKernels::Kernel K, typename Pixel>
+void _applyTiles(const std::vector<ColourSpaces::RGB>& imgData, const int& width, const int& height, std::vector<Pixel>& out, RowQueue<int>* ditheredRows){
+    int tileSize = _tileSide(width, height);
+    int tilesX = _tilesX(width, height);
+    int tilesY = _tilesY(width, height);
+    int numTiles = tilesX * tilesY;
+    std::vector<unsigned int> seeds(numTiles);
+    for(unsigned int& seed : seeds){
+        seed = _randEng();
+    }
+    std::vector<std::once_flag> trained((_localTiles())?(numTiles):(0));
+    if(_localTiles() && (_buffers.tilePalettes.size() < (size_t)numTiles)){
+        _buffers.tilePalettes.resize(numTiles);
+    }
+    PaletteRef shared = {&_colourKohonen, &_buffers.linPalette, &_buffers.rgbPalette};
+    std::vector<int> bandRemaining(tilesY, tilesX);
+    std::mutex bandMutex;
+    std::condition_variable bandDone;
+    std::atomic<int> nextTile(0);
+    std::exception_ptr error;
+    std::function<void(TileBuffers&)> worker = [&](TileBuffers& buffers){
+        std::vector<ColourSpaces::LinRGB>& errorRows = buffers.errorRows;
+        std::vector<Pixel>& rowOut = buffers.rowOut(out);
+        ColourCache& cache = buffers.cache;
+        cache.reset(_cacheBits);
+        //Palette of a tile, trained on first use
+        std::function<PaletteRef(int, int)> tilePalette = [&](int tileX, int tileY){
+            int tile = tileY * tilesX + tileX;
+            TilePalette& palette = _buffers.tilePalettes[tile];
+            std::call_once(trained[tile], [&](){
+                _trainTilePalette(palette, imgData, width, height, tileX * tileSize, tileY * tileSize, seeds[tile], buffers.sample);
+            });
+            PaletteRef ref = {&palette.kohonen, &palette.linPalette, &palette.rgbPalette};
+            return ref;
+        };
+        int tile = 0;
+        while((tile = nextTile++) < numTiles){
+            int tileX = tile % tilesX;
+            int tileY = tile / tilesX;
+            int x0 = tileX * tileSize;
+            int y0 = tileY * tileSize;
+            int x1 = std::min(x0 + tileSize, width);
+            int y1 = std::min(y0 + tileSize, height);
+            try{
+                PaletteRef palettes[2][3] = {{shared, shared, shared}, {shared, shared, shared}};
+                if(_localTiles()){
+                    PaletteRef own = tilePalette(tileX, tileY);
+                    //Margins only exist with diffusion, and neighbours outside the image give them no width
+                    for(int row = 0; row < 2; row++){
+                        for(int column = 0; column < 3; column++){
+                            int neighbourX = tileX + column - 1;
+                            int neighbourY = tileY + row - 1;
+                            bool outside = (neighbourX < 0) || (neighbourX >= tilesX) || (neighbourY < 0);
+                            palettes[row][column] = (outside || !_diffusion)?(own):(tilePalette(neighbourX, neighbourY));
+                        }
+                    }
+                    //Indexes of another tile's palette are of no use
+                    if(cache.lookups() > 0){
+                        std::lock_guard<std::mutex> lock(bandMutex);
+                        _addCacheStats(cache);
+                    }
+                    cache.reset(_cacheBits);
+                }
+                _ditherTile<K>(palettes, imgData, width, x0, y0, x1, y1, cache, errorRows, rowOut, out);
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(bandMutex);
+                if(!error){
+                    error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(bandMutex);
+                bandRemaining[tileY]--;
+            }
+            bandDone.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(bandMutex);
+        _addCacheStats(cache);
+    };
+    int numWorkers = std::min((int)_ditheringThreads(width, height), numTiles);
+    if(_buffers.tiles.size() < (size_t)numWorkers){
+        _buffers.tiles.resize(numWorkers);
+    }
+    std::vector<std::thread> workers;
+    for(int i = 0; i < numWorkers; i++){
+        workers.push_back(std::thread(worker, std::ref(_buffers.tiles[i])));
+    }
+    for(int band = 0; band < tilesY; band++){
+        {
+            std::unique_lock<std::mutex> lock(bandMutex);
+            bandDone.wait(lock, [&bandRemaining, band](){
+                return bandRemaining[band] == 0;
+            });
+        }
+        for(int y = band * tileSize; ditheredRows && (y < std::min((band + 1) * tileSize, height)); y++){
+            ditheredRows->push(y);
+        }
+    }
+    for(std::thread& thread : workers){
+        thread.join();
+    }
+    if(error){
+        std::rethrow_exception(error);
     }
-    return newImgData;
 }
 
-std::vector<unsigned char> _applyDitheringPLT(std::vector<ColourSpaces::RGB> imgData, const int& width, const int& height){
-    std::vector<ColourSpaces::XYZ> palette = _colourKohonen.getGroups();
-    std::vector<unsigned char> pltIndexes(imgData.size());
-    std::vector<ColourSpaces::LinRGB> errorBuffer = std::vector<ColourSpaces::LinRGB>();
-    errorBuffer.reserve(width*4);
-    for(int i = 0; i < width * 3; i++){
-        errorBuffer.push_back(imgData[i].toLinRGB());
+//Serpentine diffusion over a ring of 4 padded rows: the current one, 2 receiving error and 1 linearised ahead.
+//Rows below the image are replaced by a discarded fifth row. Linearising a row costs little next to its colour searches,
+//so it is done inline rather than on a thread of its own, which would cost a thread start for every row
+template<DiffusionKernels::Kernel K, typename Pixel>
+void _applyKernel(const std::vector<ColourSpaces::RGB>& imgData, const int& width, const int& height, std::vector<Pixel>& out, RowQueue<int>* ditheredRows){
+    if(_tileSize > 0){
+        _applyTiles<K>(imgData, width, height, out, ditheredRows);
+        return;
+    }
+    const std::vector<ColourSpaces::LinRGB>& linPalette = _buffers.linPalette;
+    const std::vector<ColourSpaces::RGB>& rgbPalette = _buffers.rgbPalette;
+    size_t stride = width + 2 * DiffusionKernels::PADDING;
+    std::vector<ColourSpaces::LinRGB>& errorRows = BufferPool::take(_buffers.errorRows, 5 * stride);
+    ColourSpaces::LinRGB* ring[5];
+    for(int slot = 0; slot < 5; slot++){
+        ring[slot] = &errorRows[slot * stride + DiffusionKernels::PADDING];
+    }
+    for(int y = 0; y < std::min(height, 3); y++){
+        _linearizeRow(&imgData[(size_t)y * width], width, ring[y % 4]);
     }
-    int lineStart = 0;
-    int lineStop = width;
-    char step = 1;
-    std::thread linearizer;
+    size_t colourIndex = 0;
+    _colourCache.reset(_cacheBits);
     for(int y = 0; y < height; y++){
         if(y + 3 < height){
-            linearizer = std::thread(&ColourCmprs::_ditherDataPrepThread, this, std::cref(imgData), y + 3, std::cref(width), std::ref(errorBuffer));
+            _linearizeRow(&imgData[(size_t)(y + 3) * width], width, ring[(y + 3) % 4]);
         }
-        for(int x = lineStart; x != lineStop; x += step){
-            size_t loc = y * width + x;
-            const ColourSpaces::LinRGB& oldColour = errorBuffer[x];
-            unsigned char colourIndex = _colourKohonen.closestGroupInd(oldColour.toXYZ());
-            _ditheringBodyLIN(errorBuffer, width, ((y + 2) < height)?(3):(height - y), x, 0, oldColour, palette[colourIndex].toLinRGB(), step);
-            pltIndexes[loc] = colourIndex;
+        ColourSpaces::LinRGB* rows[3] = {
+            ring[y % 4],
+            (y + 1 < height)?(ring[(y + 1) % 4]):(ring[4]),
+            (y + 2 < height)?(ring[(y + 2) % 4]):(ring[4])
+        };
+        Pixel* outRow = &out[(size_t)y * width];
+        if(!_diffusion){
+            _mapRow(_colourKohonen, _colourCache, &imgData[(size_t)y * width], rows[0], width, outRow, rgbPalette, colourIndex);
         }
-        if(y + 3 < height){
-            linearizer.join();
+        else if(y % 2 == 0){
+            _ditherRow<K, 1>(_colourKohonen, _colourCache, rows, width, outRow, linPalette, rgbPalette, colourIndex);
+        }
+        else{
+            _ditherRow<K, -1>(_colourKohonen, _colourCache, rows, width, outRow, linPalette, rgbPalette, colourIndex);
         }
-        step = -step;
-        lineStart = (lineStart == 0)?(width - 1):(0);
-        lineStop = (lineStop == width)?(-1):(width);
-        errorBuffer.erase(errorBuffer.begin(), errorBuffer.begin() + width);
+        if(ditheredRows){
+            ditheredRows->push(y);
+        }
+    }
+    _addCacheStats(_colourCache);
+}
+
+static void _convertPalette(const std::vector<ColourSpaces::XYZ>& palette, std::vector<ColourSpaces::LinRGB>& linPalette, std::vector<ColourSpaces::RGB>& rgbPalette){
+    BufferPool::take(linPalette, palette.size());
+    BufferPool::take(rgbPalette, palette.size());
+    for(size_t i = 0; i < palette.size(); i++){
+        linPalette[i] = palette[i].toLinRGB();
+        rgbPalette[i] = linPalette[i].toRGB();
+    }
+}
+
+//Converts the trained palette once for dithering and output
+void _preparePalettes(){
+    _convertPalette(_colourKohonen.groups(), _buffers.linPalette, _buffers.rgbPalette);
+}
+
+template<typename Pixel>
+void _applyDithering(const std::vector<ColourSpaces::RGB>& imgData, const int& width, const int& height, std::vector<Pixel>& out, RowQueue<int>* ditheredRows){
+    switch(_activeKernel){
+        case DiffusionKernels::FloydSteinberg:
+            _applyKernel<DiffusionKernels::FloydSteinberg>(imgData, width, height, out, ditheredRows);
+            break;
+        case DiffusionKernels::SierraLite:
+            _applyKernel<DiffusionKernels::SierraLite>(imgData, width, height, out, ditheredRows);
+            break;
+        case DiffusionKernels::Atkinson:
+            _applyKernel<DiffusionKernels::Atkinson>(imgData, width, height, out, ditheredRows);
+            break;
+        default:
+            _applyKernel<DiffusionKernels::JarvisJudiceNinke>(imgData, width, height, out, ditheredRows);
+            break;
     }
-    return pltIndexes;
 }
 
 public:
@@ -167,75 +832,261 @@ _minDiffPercent(minDiff),
 _learningRate(learningRate),
 _percentage(percentage){}
 
-void process(const std::string src, const std::string dest, const bool& verbal){
+static bool validParameters(const int& numMaxColours, const int& percentage, const double& maxDiff, const double& minDiff, const double& learningRate){
+    return (numMaxColours >= 1) 
+        && (percentage >= 0) && (percentage <= 100) 
+        && (maxDiff >= 1.0) && (maxDiff <= 100.0) 
+        && (minDiff >= 1.0) && (minDiff <= 100.0) 
+        && (learningRate > 0) && (learningRate <= 1);
+}
+
+void setParameters(const size_t& numMaxColours, const double& maxDiff, const double& minDiff, uint8_t percentage, const double& learningRate){
+    _numMaxColours = numMaxColours;
+    _maxDiffPercent = maxDiff;
+    _minDiffPercent = minDiff;
+    _percentage = percentage;
+    _learningRate = learningRate;
+}
+
+void usePalette(const std::vector<ColourSpaces::XYZ>& palette){
+    _presetPalette = palette;
+}
+
+std::vector<ColourSpaces::XYZ> getPalette(){
+    return _colourKohonen.getGroups();
+}
+
+void setTimeBudget(const size_t& milliSeconds){
+    _timeBudget = milliSeconds;
+}
+
+const std::vector<std::string>& getDegradations() const {
+    return _degradations;
+}
+
+void setPipelined(const bool& pipelined){
+    _pipelined = pipelined;
+}
+
+void setKernel(const DiffusionKernels::Kernel& kernel){
+    _kernel = kernel;
+}
+
+void setSeededSearch(const bool& seededSearch){
+    _seededSearch = seededSearch;
+}
+
+//Tile size in pixels, 0 turns tiling off. With local palettes every tile trains its own palette and output is RGB
+void setTiles(const size_t& tileSize, const bool& localPalettes){
+    _tileSize = tileSize;
+    _localPalettes = localPalettes;
+}
+
+void setCacheBits(const int& bits){
+    _cacheBits = bits;
+}
+
+//Nearest colour cache hits and lookups of the last process() call
+size_t getCacheHits() const {
+    return _cacheHits;
+}
+
+size_t getCacheLookups() const {
+    return _cacheLookups;
+}
+
+//Frees every pooled buffer once they hold more than maxBytes, so one huge image does not stay resident between images
+void trimBuffers(const size_t& maxBytes){
+    if(_buffers.bytes() > maxBytes){
+        _buffers = BufferPool();
+    }
+}
+
+void process(ImageIO::Source src, ImageIO::Destination dest, const bool& verbal){
     std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::time_point<std::chrono::high_resolution_clock>();
     std::chrono::time_point<std::chrono::high_resolution_clock> stop = std::chrono::time_point<std::chrono::high_resolution_clock>();
-    _colourKohonen = DKohonen<ColourSpaces::XYZ>([this](const ColourSpaces::XYZ& xyz1, const ColourSpaces::XYZ& xyz2){
-            return ColourSpaces::CIEDE2000(xyz1.toLAB(), xyz2.toLAB());
-        });
+    _deadline = std::chrono::high_resolution_clock::now() + std::chrono::milliseconds(_timeBudget);
+    _degradations.clear();
+    _fastSearch = false;
+    _diffusion = true;
+    _activeKernel = _kernel;
+    _activeSeededSearch = _seededSearch;
+    _compressionLevel = Z_BEST_COMPRESSION;
+    _tileSampleShare = 1.0;
+    _cacheHits = 0;
+    _cacheLookups = 0;
+    _colourKohonen = DKohonen<ColourSpaces::XYZ>(&ColourCmprs::_preciseMetric);
+    if(!_presetPalette.empty()){
+        _colourKohonen.setGroups(_presetPalette);
+    }
     int height = 0;
     int width = 0;
-    std::vector<ColourSpaces::RGB> rgbData = ImageIO::readImageRGB(src.c_str(), width, height);
-    if(verbal == true){
-        std::cout << "Image read";
-    } 
-    std::vector<ColourSpaces::RGB> learningRGBData = rgbData;
-    std::shuffle(learningRGBData.begin(), learningRGBData.end(), _randEng);
-    size_t toProcess = learningRGBData.size() * _percentage / 100.0;
-    if(verbal == true){
-        std::cout << std::endl << toProcess << " pixels will be processed. Started training Kohonen neural network";
-        start = std::chrono::high_resolution_clock::now();
-    } 
     double minDiff = 119.475 * _minDiffPercent / 100.0;
     double maxDiff = 119.475 * _maxDiffPercent / 100.0;
-    for(size_t i = 0; i < toProcess; i++){
-        //std::cout << toProcess << "/" << i << std::endl;
-        _colourKohonen.trainStep(learningRGBData[i].toLinRGB().toXYZ(), _numMaxColours, maxDiff, minDiff, _learningRate);
+    std::vector<ColourSpaces::RGB>& rgbData = _buffers.image;
+    if(_pipelined){
+        ImageIO::RowReader reader(src, &_buffers.rows);
+        width = reader.width();
+        height = reader.height();
+        BufferPool::take(rgbData, (size_t)width * height);
+        if(verbal == true){
+            std::cout << "Image header read. Started decoding and training Kohonen neural network row by row";
+            start = std::chrono::high_resolution_clock::now();
+        }
+        RowQueue<int> decodedRows(_rowQueueCapacity);
+        std::exception_ptr decodeError;
+        std::thread decoder(&ColourCmprs::_decodeThread, this, std::ref(reader), std::ref(rgbData), std::ref(decodedRows), std::ref(decodeError));
+        size_t trained = 0;
+        try{
+            trained = _trainPipelined(rgbData, width, decodedRows, maxDiff, minDiff);
+        }
+        catch(...){
+            decodedRows.close();
+            decoder.join();
+            throw;
+        }
+        decoder.join();
+        if(decodeError){
+            std::rethrow_exception(decodeError);
+        }
+        if((verbal == true) && !_localTiles()){
+            std::cout << std::endl << trained << " pixels were processed";
+        }
+    }
+    else{
+        ImageIO::readImageRGB(src, rgbData, width, height, &_buffers.rows);
+        if(verbal == true){
+            std::cout << "Image read";
+        } 
+        size_t toProcess = (_presetPalette.empty())?(rgbData.size() * _percentage / 100.0):(0);
+        std::chrono::time_point<std::chrono::high_resolution_clock> trainingDeadline = _planTraining(rgbData.data(), rgbData.size(), width, height, toProcess);
+        if(_localTiles()){
+            toProcess = 0;
+        }
+        std::vector<ColourSpaces::RGB>& learningRGBData = _sampleLearningData(rgbData, toProcess);
+        if((verbal == true) && !_localTiles()){
+            std::cout << std::endl << toProcess << " pixels will be processed. Started training Kohonen neural network";
+            start = std::chrono::high_resolution_clock::now();
+        } 
+        for(size_t i = 0; i < toProcess; i++){
+            //std::cout << toProcess << "/" << i << std::endl;
+            if(!_trainPixel(learningRGBData[i], i, toProcess, trainingDeadline, maxDiff, minDiff)){
+                break;
+            }
+        }
+    }
+    if(_colourKohonen.groups().empty() && !_localTiles()){
+        throw std::runtime_error("No colours were learned, learning portion is too small");
+    }
+    if(_timeBudget > 0){
+        size_t paletteSize = (_localTiles())?(_numMaxColours):(_colourKohonen.groups().size());
+        double remaining = _remainingNs();
+        _fitToBudget(width, height, paletteSize, remaining);
+        double estimate = _ditheringEstimate(width, height, paletteSize);
+        if(estimate > remaining){
+            std::stringstream degradation;
+            degradation << "budget cannot be met, dithering and encoding are estimated to take " << (long long)(estimate / 1e6) << " of " << (long long)(std::max(remaining, 0.0) / 1e6) << " milliseconds left";
+            _degradations.push_back(degradation.str());
+        }
+    }
+    //Local palettes may differ from tile to tile, so only RGB output can hold them
+    bool rgbOutput = _localTiles() || (_colourKohonen.groups().size() > 256);
+    if(_fastSearch){
+        _colourKohonen.setMetric(&ColourCmprs::_fastMetric);
+    }
+    if(_activeSeededSearch){
+        _colourKohonen.buildNeighbourTable();
     }
-    learningRGBData.clear();
-    learningRGBData.shrink_to_fit();
     if(verbal == true){
         stop = std::chrono::high_resolution_clock::now();
         size_t milliSeconds = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
-        std::cout 
-            << std::endl 
-            << _colourKohonen.getGroups().size() << " unique colours identified. " 
-            << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)" << std::endl 
-            <<  "Began dithering";
+        if(_localTiles()){
+            std::cout << std::endl << "Began training a palette and dithering for every tile of " << _tileSize << " pixels";
+        }
+        else{
+            std::cout 
+                << std::endl 
+                << _colourKohonen.groups().size() << " unique colours identified. " 
+                << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)" << std::endl 
+                <<  "Began dithering";
+            if(_tileSize > 0){
+                std::cout << " in tiles of " << _tileSize << " pixels";
+            }
+        }
+        if(_pipelined){
+            std::cout << ", rows are encoded in " << ((rgbOutput)?("RGB"):("PLT")) << " mode as they are done";
+        }
         start = std::chrono::high_resolution_clock::now();
     }
-    if(_colourKohonen.getGroups().size() > 256){
-        std::vector<ColourSpaces::RGB> dithered = _applyDithering(rgbData, width, height);
+    _preparePalettes();
+    if(rgbOutput){
+        std::vector<ColourSpaces::RGB>& dithered = BufferPool::take(_buffers.ditheredRgb, rgbData.size());
+        if(_pipelined){
+            ImageIO::RgbRowWriter writer(dest, width, height, _compressionLevel, &_buffers.rows);
+            _ditherAndEncode(writer, rgbData, dithered, width, height, &ColourCmprs::_applyDithering<ColourSpaces::RGB>);
+        }
+        else{
+            _applyDithering(rgbData, width, height, dithered, nullptr);
+        }
         if(verbal == true){
             stop = std::chrono::high_resolution_clock::now();
             size_t milliSeconds = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
             std::cout 
                 << std::endl 
                 << "Dithering done. "
-                << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)" << std::endl
-                << "Image will be written in RGB mode";
+                << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)";
+            if(!_pipelined){
+                std::cout << std::endl << "Image will be written in RGB mode";
+            }
         } 
-        ImageIO::writeImageRgb(dest.c_str(), dithered, width, height);
+        if(!_pipelined){
+            ImageIO::writeImageRgb(dest, dithered, width, height, _compressionLevel, &_buffers.rows);
+        }
     }
     else{
-        std::vector<ColourSpaces::XYZ> xyzPallette = _colourKohonen.getGroups();
-        std::vector<ColourSpaces::RGB> rgbPallete;
-        for(const ColourSpaces::XYZ& valXYZ : xyzPallette){
-            rgbPallete.push_back(valXYZ.toLinRGB().toRGB());
+        const std::vector<ColourSpaces::RGB>& rgbPallete = _buffers.rgbPalette;
+        std::vector<unsigned char>& dithered = BufferPool::take(_buffers.ditheredPlt, rgbData.size());
+        if(_pipelined){
+            ImageIO::PltRowWriter writer(dest, rgbPallete, width, height, _compressionLevel, &_buffers.rows);
+            _ditherAndEncode(writer, rgbData, dithered, width, height, &ColourCmprs::_applyDithering<unsigned char>);
+        }
+        else{
+            _applyDithering(rgbData, width, height, dithered, nullptr);
         }
-        std::vector<unsigned char> dithered = _applyDitheringPLT(rgbData, width, height);
-        stop = std::chrono::high_resolution_clock::now();
-        size_t milliSeconds = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
         if(verbal == true){
             stop = std::chrono::high_resolution_clock::now();
             size_t milliSeconds = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
             std::cout 
                 << std::endl 
                 << "Dithering done. "
-                << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)" << std::endl
-                << "Image will be written in PLT mode";
+                << "Took " << milliSeconds << " milliseconds (" << (double)milliSeconds/1000 << " seconds)";
+            if(!_pipelined){
+                std::cout << std::endl << "Image will be written in PLT mode";
+            }
         } 
-        ImageIO::writeImagePLT(dest.c_str(), dithered, rgbPallete, width, height);
+        if(!_pipelined){
+            ImageIO::writeImagePLT(dest, dithered, rgbPallete, width, height, _compressionLevel, &_buffers.rows);
+        }
+    }
+    if((verbal == true) && (_cacheLookups > 0)){
+        std::cout 
+            << std::endl 
+            << "Colour cache hits: " << _cacheHits << " of " << _cacheLookups 
+            << " (" << 100.0 * _cacheHits / _cacheLookups << "%)";
+    }
+    if((verbal == true) && (_timeBudget > 0)){
+        std::cout << std::endl << "Time budget of " << _timeBudget << " milliseconds. ";
+        if(_degradations.empty()){
+            std::cout << "No degradations were needed";
+        }
+        else{
+            std::cout << "Applied degradations:";
+            for(const std::string& degradation : _degradations){
+                std::cout << std::endl << " - " << degradation;
+            }
+        }
     }
 }
-};
\ No newline at end of file
+};
+
+#endif
\ No newline at end of file
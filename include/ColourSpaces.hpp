@@ -245,6 +245,13 @@ namespace ColourSpaces{
         double corrTerm = R * deltaCCorr * dH / (Sc * Sh);
         return sqrt(pow(dL / Sl, 2) + pow(deltaCCorr / Sc, 2) + pow(dH / Sh, 2) + corrTerm);
     }
+
+    double CIE76(const ColourSpaces::LAB& lab1, const ColourSpaces::LAB& lab2) {
+        double dL = lab2.l - lab1.l;
+        double dA = lab2.a - lab1.a;
+        double dB = lab2.b - lab1.b;
+        return sqrt(dL * dL + dA * dA + dB * dB);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -20,6 +20,9 @@ private:
 
 	std::vector<T> _weights;
 
+	//For every node the other nodes with their distances, nearest first. Empty until buildNeighbourTable()
+	std::vector<std::vector<std::pair<double, size_t>>> _neighbours;
+
 	double _eucDist(const std::vector<double>& x1, const std::vector<double>& x2) {
 		if (x1.size() != x2.size()) {
 			throw std::runtime_error("Invalid dimensions");
@@ -52,6 +55,37 @@ private:
 		return _closestNodeInd(data, dist);
 	}
 
+	//Orchard's search starting from a guess. A node j can only beat the current best b when
+	//dist(b, j) < 2 * dist(data, b), so every scan of b's sorted neighbours stops at the first farther one.
+	//Exact for metrics obeying the triangle inequality, close to exact for CIEDE2000
+	size_t _closestNodeIndFrom(const T& data, const size_t& seed) {
+		if (_weights.size() == 0) {
+			throw std::runtime_error("Use of untrained network");
+		}
+		if ((_neighbours.size() != _weights.size()) || (seed >= _weights.size())) {
+			return _closestNodeInd(data);
+		}
+		size_t minInd = seed;
+		double minDist = _metric(data, _weights[seed]);
+		bool improved = true;
+		while(improved){
+			improved = false;
+			for(const std::pair<double, size_t>& neighbour : _neighbours[minInd]){
+				if(neighbour.first >= 2 * minDist){
+					break;
+				}
+				double dist = _metric(data, _weights[neighbour.second]);
+				if(dist < minDist){
+					minInd = neighbour.second;
+					minDist = dist;
+					improved = true;
+					break;
+				}
+			}
+		}
+		return minInd;
+	}
+
 	/*
 	size_t _closestNodeInd(const std::vector<double>& data, double& dist) {
 		size_t minInd = _closestNodeInd(data);
@@ -100,7 +134,13 @@ public:
 	DKohonen() = default;
 	DKohonen(std::function<double(const T&, const T&)> metric) : _metric(metric) {};
 
+	void setMetric(std::function<double(const T&, const T&)> metric){
+		_metric = metric;
+		_neighbours.clear();
+	}
+
 	void trainStep(const T& dataPiece, const size_t& maxClusters, const double& maxDistance, const double& minDist, const double& learningRate){
+		_neighbours.clear();
 		if (_weights.size() == 0) {
 				_weights.push_back(dataPiece);
 				return;
@@ -153,9 +193,37 @@ public:
 		return _weights;
 	}
 
+	const std::vector<T>& groups() const {
+		return _weights;
+	}
+
+	void setGroups(const std::vector<T>& groups){
+		_weights = groups;
+		_neighbours.clear();
+	}
+
+	//Precomputes node to node distances for closestGroupIndFrom. Training steps invalidate the table
+	void buildNeighbourTable(){
+		_neighbours.assign(_weights.size(), std::vector<std::pair<double, size_t>>());
+		for (size_t i = 0; i < _weights.size(); i++) {
+			for (size_t j = i + 1; j < _weights.size(); j++) {
+				double dist = _metric(_weights[i], _weights[j]);
+				_neighbours[i].push_back(std::make_pair(dist, j));
+				_neighbours[j].push_back(std::make_pair(dist, i));
+			}
+		}
+		for (std::vector<std::pair<double, size_t>>& nodeNeighbours : _neighbours) {
+			std::sort(nodeNeighbours.begin(), nodeNeighbours.end());
+		}
+	}
+
 	size_t closestGroupInd(const T& data){
 		return _closestNodeInd(data);
 	}
+
+	size_t closestGroupIndFrom(const T& data, const size_t& seed){
+		return _closestNodeIndFrom(data, seed);
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,450 @@
+#ifndef DAEMON_HPP
+#define DAEMON_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "ColourCmprs.hpp"
+
+//Long-running server. Jobs are read from stdin or from Unix domain socket connections
+//and processed on a persistent pool of workers, each reusing its own ColourCmprs.
+//
+//Request: a header line, followed by PNG bytes for bytes: sources
+//    <id> <max_colors> <learning_portion> <difference_threshold> <sameness_threshold> <learning_rate> <source> [budget=<ms>] [pipeline=<0|1>] [kernel=<name>] [search=<full|orchard>]
+//        [tiles=<size>] [tile-palette=<shared|local>] [cache-bits=<bits>] [palette=<key>]
+//    <source> is path:<file> or bytes:<length>, option values are those of the matching command line options
+//    palette=<key> reuses the palette trained by an earlier job with the same key instead of training
+//Response: a header line followed by <length> bytes of payload
+//    <id> ok <length> [cache=<hits>/<lookups>] [degradations=<count>]    result PNG
+//    <id> error <length>                                                 error message
+//    cache= is sent when the colour cache was used, degradations= for jobs with a budget. The header is then
+//    followed by <count> lines, each naming a degradation the budget needed, and the payload comes after them
+//Responses are sent as jobs finish, ids match them to requests. A "quit" line closes the connection.
+//Header lines are at most 4096 bytes. A connection's next request is not read while the job queue is full
+class Daemon{
+private:
+    class Connection{
+    private:
+        int _in = -1;
+        int _out = -1;
+        bool _own = false;
+        std::mutex _writeMutex;
+        std::vector<char> _buffer = std::vector<char>(65536);
+        size_t _pos = 0;
+        size_t _end = 0;
+
+        bool _fill(){
+            ssize_t got = 0;
+            do{
+                got = read(_in, _buffer.data(), _buffer.size());
+            } while((got < 0) && (errno == EINTR));
+            if(got <= 0){
+                return false;
+            }
+            _pos = 0;
+            _end = got;
+            return true;
+        }
+
+        bool _writeAll(const char* data, size_t length){
+            while(length > 0){
+                ssize_t written = write(_out, data, length);
+                if(written < 0){
+                    if(errno == EINTR){
+                        continue;
+                    }
+                    return false;
+                }
+                data += written;
+                length -= written;
+            }
+            return true;
+        }
+
+    public:
+        Connection(const int& in, const int& out, const bool& own) : _in(in), _out(out), _own(own) {}
+
+        ~Connection(){
+            if(_own){
+                close(_in);
+            }
+        }
+
+        //Throws when the line grows past maxLength, the stream can not be followed after that
+        bool readLine(std::string& line, const size_t& maxLength){
+            line.clear();
+            while(true){
+                if((_pos == _end) && !_fill()){
+                    return !line.empty();
+                }
+                char c = _buffer[_pos++];
+                if(c == '\n'){
+                    return true;
+                }
+                if(c != '\r'){
+                    if(line.size() == maxLength){
+                        throw std::runtime_error("Request header is too long");
+                    }
+                    line.push_back(c);
+                }
+            }
+        }
+
+        bool readBytes(std::vector<unsigned char>& bytes, const size_t& length){
+            bytes.resize(length);
+            size_t done = 0;
+            while(done < length){
+                if((_pos == _end) && !_fill()){
+                    return false;
+                }
+                size_t chunk = std::min(length - done, _end - _pos);
+                std::copy(_buffer.begin() + _pos, _buffer.begin() + _pos + chunk, bytes.begin() + done);
+                _pos += chunk;
+                done += chunk;
+            }
+            return true;
+        }
+
+        //fields are appended to the header line, every one of notes follows it on its own line
+        void respond(
+            const std::string& id, 
+            const std::string& status, 
+            const unsigned char* data, 
+            const size_t& length, 
+            const std::string& fields = std::string(), 
+            const std::vector<std::string>& notes = std::vector<std::string>()){
+            std::stringstream header;
+            header << id << " " << status << " " << length << fields << "\n";
+            for(const std::string& note : notes){
+                header << note << "\n";
+            }
+            std::string headerStr = header.str();
+            std::lock_guard<std::mutex> lock(_writeMutex);
+            if(_writeAll(headerStr.data(), headerStr.size())){
+                _writeAll(reinterpret_cast<const char*>(data), length);
+            }
+        }
+
+        void respondError(const std::string& id, const std::string& message){
+            respond(id, "error", reinterpret_cast<const unsigned char*>(message.data()), message.size());
+        }
+    };
+
+    struct Job{
+        std::shared_ptr<Connection> connection;
+        std::string id;
+        int numColours = 0;
+        int learnPercent = 0;
+        double diffPercentage = 0;
+        double samenessPercentage = 0;
+        double learningRate = 0;
+        int timeBudget = 0;
+        bool pipelined = false;
+        DiffusionKernels::Kernel kernel = DiffusionKernels::JarvisJudiceNinke;
+        bool seededSearch = false;
+        int tileSize = 0;
+        bool localPalettes = false;
+        int cacheBits = 0;
+        std::string path;
+        std::vector<unsigned char> bytes;
+        std::string paletteKey;
+    };
+
+    std::deque<Job> _jobs;
+    std::mutex _jobsMutex;
+    std::condition_variable _jobsCondition;
+    //Readers wait for space before reading a request, so a full queue holds back clients instead of growing
+    std::condition_variable _spaceCondition;
+    size_t _maxQueuedJobs = 16;
+    size_t _maxHeaderBytes = 4096;
+    bool _stopping = false;
+    std::vector<std::thread> _workers;
+
+    //Trained palettes by client given key, oldest are dropped first
+    std::map<std::string, std::vector<ColourSpaces::XYZ>> _palettes;
+    std::deque<std::string> _paletteOrder;
+    std::mutex _palettesMutex;
+    size_t _maxPalettes = 64;
+    //Largest bytes: payload accepted, bigger requests close the connection
+    long long _maxPayloadBytes = (long long)256 << 20;
+    //Buffers a worker keeps between jobs, more is freed after the job that needed it
+    size_t _maxPooledBytes = (size_t)64 << 20;
+
+    bool _findPalette(const std::string& key, std::vector<ColourSpaces::XYZ>& palette){
+        std::lock_guard<std::mutex> lock(_palettesMutex);
+        std::map<std::string, std::vector<ColourSpaces::XYZ>>::iterator found = _palettes.find(key);
+        if(found == _palettes.end()){
+            return false;
+        }
+        palette = found->second;
+        return true;
+    }
+
+    void _storePalette(const std::string& key, const std::vector<ColourSpaces::XYZ>& palette){
+        std::lock_guard<std::mutex> lock(_palettesMutex);
+        if(_palettes.count(key) == 0){
+            _paletteOrder.push_back(key);
+        }
+        _palettes[key] = palette;
+        if(_paletteOrder.size() > _maxPalettes){
+            _palettes.erase(_paletteOrder.front());
+            _paletteOrder.pop_front();
+        }
+    }
+
+    void _worker(){
+        ColourCmprs imgCmprs(16, 50, 50, 50, 0.0001);
+        std::vector<unsigned char> result;
+        std::vector<ColourSpaces::XYZ> palette;
+        while(true){
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_jobsMutex);
+                _jobsCondition.wait(lock, [this](){
+                    return _stopping || !_jobs.empty();
+                });
+                if(_jobs.empty()){
+                    return;
+                }
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+            _spaceCondition.notify_one();
+            try{
+                imgCmprs.setParameters(job.numColours, job.diffPercentage, job.samenessPercentage, job.learnPercent, job.learningRate);
+                imgCmprs.setTimeBudget(job.timeBudget);
+                imgCmprs.setPipelined(job.pipelined);
+                imgCmprs.setKernel(job.kernel);
+                imgCmprs.setSeededSearch(job.seededSearch);
+                imgCmprs.setTiles(job.tileSize, job.localPalettes);
+                imgCmprs.setCacheBits(job.cacheBits);
+                bool cached = !job.paletteKey.empty() && _findPalette(job.paletteKey, palette);
+                imgCmprs.usePalette((cached)?(palette):(std::vector<ColourSpaces::XYZ>()));
+                if(job.path.empty()){
+                    imgCmprs.process(job.bytes, result, false);
+                }
+                else{
+                    imgCmprs.process(job.path, result, false);
+                }
+                //Tiles with local palettes leave no single palette to reuse
+                if(!job.paletteKey.empty() && !cached && !imgCmprs.getPalette().empty()){
+                    _storePalette(job.paletteKey, imgCmprs.getPalette());
+                }
+                std::stringstream fields;
+                if(imgCmprs.getCacheLookups() > 0){
+                    fields << " cache=" << imgCmprs.getCacheHits() << "/" << imgCmprs.getCacheLookups();
+                }
+                std::vector<std::string> notes;
+                if(job.timeBudget > 0){
+                    notes = imgCmprs.getDegradations();
+                    fields << " degradations=" << notes.size();
+                }
+                job.connection->respond(job.id, "ok", result.data(), result.size(), fields.str(), notes);
+            }
+            catch(const std::exception& e){
+                job.connection->respondError(job.id, e.what());
+            }
+            catch(...){
+                job.connection->respondError(job.id, "Unknown error");
+            }
+            imgCmprs.trimBuffers(_maxPooledBytes);
+            if(result.capacity() > _maxPooledBytes){
+                std::vector<unsigned char>().swap(result);
+            }
+        }
+    }
+
+    //Parses a request header and reads its payload. Returns false when the stream can not be followed any more
+    bool _readJob(const std::string& header, Connection& connection, Job& job, std::string& error){
+        std::istringstream tokens(header);
+        std::string source;
+        tokens >> job.id >> job.numColours >> job.learnPercent >> job.diffPercentage >> job.samenessPercentage >> job.learningRate >> source;
+        if(tokens.fail()){
+            error = "Malformed request header";
+            return header.find(" bytes:") == std::string::npos;
+        }
+        std::string option;
+        while(tokens >> option){
+            if(option.compare(0, 7, "budget=") == 0){
+                job.timeBudget = atoi(option.c_str() + 7);
+            }
+            else if((option == "pipeline=0") || (option == "pipeline=1")){
+                job.pipelined = (option == "pipeline=1");
+            }
+            else if(option.compare(0, 7, "kernel=") == 0){
+                if(!DiffusionKernels::fromName(option.substr(7), job.kernel)){
+                    error = "Unknown kernel " + option.substr(7);
+                }
+            }
+            else if((option == "search=full") || (option == "search=orchard")){
+                job.seededSearch = (option == "search=orchard");
+            }
+            else if(option.compare(0, 6, "tiles=") == 0){
+                job.tileSize = atoi(option.c_str() + 6);
+                if(job.tileSize < 16){
+                    error = "Invalid tile size";
+                }
+            }
+            else if((option == "tile-palette=shared") || (option == "tile-palette=local")){
+                job.localPalettes = (option == "tile-palette=local");
+            }
+            else if(option.compare(0, 11, "cache-bits=") == 0){
+                job.cacheBits = atoi(option.c_str() + 11);
+                if((job.cacheBits < 1) || (job.cacheBits > 21)){
+                    error = "Invalid cache bits";
+                }
+            }
+            else if(option.compare(0, 8, "palette=") == 0){
+                job.paletteKey = option.substr(8);
+            }
+            else{
+                error = "Unknown option " + option;
+            }
+        }
+        if(source.compare(0, 5, "path:") == 0){
+            job.path = source.substr(5);
+        }
+        else if(source.compare(0, 6, "bytes:") == 0){
+            long long length = atoll(source.c_str() + 6);
+            if(length > _maxPayloadBytes){
+                error = "Image bytes exceed the limit";
+                return false;
+            }
+            if((length <= 0) || !connection.readBytes(job.bytes, length)){
+                error = "Image bytes could not be read";
+                return false;
+            }
+        }
+        else{
+            error = "Unknown source " + source;
+        }
+        if(error.empty() && (!ColourCmprs::validParameters(job.numColours, job.learnPercent, job.diffPercentage, job.samenessPercentage, job.learningRate) || (job.timeBudget < 0))){
+            error = "Invalid parameters";
+        }
+        return true;
+    }
+
+    void _serve(std::shared_ptr<Connection> connection){
+        std::string header;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(_jobsMutex);
+                _spaceCondition.wait(lock, [this](){
+                    return _stopping || (_jobs.size() < _maxQueuedJobs);
+                });
+            }
+            try{
+                if(!connection->readLine(header, _maxHeaderBytes)){
+                    break;
+                }
+            }
+            catch(const std::exception& e){
+                connection->respondError("", e.what());
+                break;
+            }
+            if(header.empty()){
+                continue;
+            }
+            if(header == "quit"){
+                break;
+            }
+            Job job;
+            job.connection = connection;
+            std::string error;
+            bool inSync = false;
+            try{
+                inSync = _readJob(header, *connection, job, error);
+            }
+            catch(const std::exception& e){
+                error = e.what();
+            }
+            if(!error.empty()){
+                connection->respondError(job.id, error);
+            }
+            if(!inSync){
+                break;
+            }
+            if(error.empty()){
+                std::lock_guard<std::mutex> lock(_jobsMutex);
+                _jobs.push_back(std::move(job));
+                _jobsCondition.notify_one();
+            }
+        }
+    }
+
+public:
+    Daemon(const size_t& numWorkers){
+        signal(SIGPIPE, SIG_IGN);
+        for(size_t i = 0; i < std::max(numWorkers, (size_t)1); i++){
+            _workers.push_back(std::thread(&Daemon::_worker, this));
+        }
+    }
+
+    //Finishes queued jobs before returning
+    ~Daemon(){
+        {
+            std::lock_guard<std::mutex> lock(_jobsMutex);
+            _stopping = true;
+        }
+        _jobsCondition.notify_all();
+        for(std::thread& worker : _workers){
+            worker.join();
+        }
+    }
+
+    //Serves requests from stdin until it is closed, responses go to stdout
+    void serveStdio(){
+        _serve(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false));
+    }
+
+    //Serves every connection of a Unix domain socket on its own reader thread. Never returns on success
+    void serveSocket(const std::string& path){
+        sockaddr_un address = sockaddr_un();
+        if(path.size() >= sizeof(address.sun_path)){
+            throw std::runtime_error("Socket path \"" + path + "\" is too long");
+        }
+        address.sun_family = AF_UNIX;
+        std::copy(path.begin(), path.end(), address.sun_path);
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listener < 0){
+            throw std::runtime_error("Socket could not be made");
+        }
+        //A stale socket of an earlier run is replaced, any other file is left alone and bind fails
+        struct stat existing;
+        if((lstat(path.c_str(), &existing) == 0) && S_ISSOCK(existing.st_mode)){
+            unlink(path.c_str());
+        }
+        if((bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) || (listen(listener, 64) < 0)){
+            close(listener);
+            throw std::runtime_error("Socket \"" + path + "\" could not be bound");
+        }
+        while(true){
+            int client = accept(listener, NULL, NULL);
+            if(client < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                close(listener);
+                throw std::runtime_error("Socket connection could not be accepted");
+            }
+            std::thread(&Daemon::_serve, this, std::make_shared<Connection>(client, client, true)).detach();
+        }
+    }
+};
+
+#endif
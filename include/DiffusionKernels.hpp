@@ -0,0 +1,127 @@
+#ifndef DIFFUSION_KERNELS_HPP
+#define DIFFUSION_KERNELS_HPP
+
+#include <string>
+
+#include "ColourSpaces.hpp"
+
+//Error diffusion kernels. Every kernel is a specialisation of Taps with its coefficients unrolled,
+//S is the scan direction of the serpentine (1 or -1), so mirrored offsets are compile-time constants too.
+//rows[0] is the current row, rows[1] and rows[2] the next ones. Rows are padded by PADDING pixels on both sides
+//and rows below the image point to a discarded row, so taps need no bounds checks
+namespace DiffusionKernels{
+    enum Kernel{
+        FloydSteinberg,
+        SierraLite,
+        Atkinson,
+        JarvisJudiceNinke
+    };
+
+    const int PADDING = 2;
+
+    inline void addError(ColourSpaces::LinRGB& pixel, const ColourSpaces::LinRGB& err, const double& coeff){
+        pixel.r += err.r * coeff;
+        pixel.g += err.g * coeff;
+        pixel.b += err.b * coeff;
+    }
+
+    template<Kernel K>
+    struct Taps;
+
+    template<>
+    struct Taps<FloydSteinberg>{
+        static const int count = 4;
+
+        template<int S>
+        static void diffuse(ColourSpaces::LinRGB* const* rows, const int& x, const ColourSpaces::LinRGB& err){
+            addError(rows[0][x + S], err, 7.0/16.0);
+            addError(rows[1][x - S], err, 3.0/16.0);
+            addError(rows[1][x], err, 5.0/16.0);
+            addError(rows[1][x + S], err, 1.0/16.0);
+        }
+    };
+
+    template<>
+    struct Taps<SierraLite>{
+        static const int count = 3;
+
+        template<int S>
+        static void diffuse(ColourSpaces::LinRGB* const* rows, const int& x, const ColourSpaces::LinRGB& err){
+            addError(rows[0][x + S], err, 2.0/4.0);
+            addError(rows[1][x - S], err, 1.0/4.0);
+            addError(rows[1][x], err, 1.0/4.0);
+        }
+    };
+
+    //Spreads only 6/8 of the error, which keeps contrast in flat areas
+    template<>
+    struct Taps<Atkinson>{
+        static const int count = 6;
+
+        template<int S>
+        static void diffuse(ColourSpaces::LinRGB* const* rows, const int& x, const ColourSpaces::LinRGB& err){
+            addError(rows[0][x + S], err, 1.0/8.0);
+            addError(rows[0][x + 2 * S], err, 1.0/8.0);
+            addError(rows[1][x - S], err, 1.0/8.0);
+            addError(rows[1][x], err, 1.0/8.0);
+            addError(rows[1][x + S], err, 1.0/8.0);
+            addError(rows[2][x], err, 1.0/8.0);
+        }
+    };
+
+    //Jarvis-Judice-Ninke shaped kernel over 48, the original chromini kernel
+    template<>
+    struct Taps<JarvisJudiceNinke>{
+        static const int count = 12;
+
+        template<int S>
+        static void diffuse(ColourSpaces::LinRGB* const* rows, const int& x, const ColourSpaces::LinRGB& err){
+            addError(rows[0][x + S], err, 7.0/48.0);
+            addError(rows[0][x + 2 * S], err, 5.0/48.0);
+            addError(rows[1][x - 2], err, 3.0/48.0);
+            addError(rows[1][x - 1], err, 5.0/48.0);
+            addError(rows[1][x], err, 7.0/48.0);
+            addError(rows[1][x + 1], err, 5.0/48.0);
+            addError(rows[1][x + 2], err, 3.0/48.0);
+            addError(rows[2][x - 2], err, 1.0/48.0);
+            addError(rows[2][x - 1], err, 3.0/48.0);
+            addError(rows[2][x], err, 5.0/48.0);
+            addError(rows[2][x + 1], err, 3.0/48.0);
+            addError(rows[2][x + 2], err, 1.0/48.0);
+        }
+    };
+
+    int tapCount(const Kernel& kernel){
+        switch(kernel){
+            case FloydSteinberg:
+                return Taps<FloydSteinberg>::count;
+            case SierraLite:
+                return Taps<SierraLite>::count;
+            case Atkinson:
+                return Taps<Atkinson>::count;
+            default:
+                return Taps<JarvisJudiceNinke>::count;
+        }
+    }
+
+    bool fromName(const std::string& name, Kernel& kernel){
+        if(name == "fs"){
+            kernel = FloydSteinberg;
+        }
+        else if(name == "sierra-lite"){
+            kernel = SierraLite;
+        }
+        else if(name == "atkinson"){
+            kernel = Atkinson;
+        }
+        else if(name == "jjn"){
+            kernel = JarvisJudiceNinke;
+        }
+        else{
+            return false;
+        }
+        return true;
+    }
+}
+
+#endif
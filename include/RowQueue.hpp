@@ -0,0 +1,57 @@
+#ifndef ROW_QUEUE_HPP
+#define ROW_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+//Bounded blocking queue handing rows from one pipeline stage to the next.
+//After close() pushes are dropped and pop() drains what is left
+template<typename T>
+class RowQueue{
+private:
+    std::deque<T> _items;
+    size_t _capacity = 0;
+    bool _closed = false;
+    std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+
+public:
+    RowQueue(const size_t& capacity) : _capacity(capacity) {}
+
+    void push(const T& item){
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notFull.wait(lock, [this](){
+            return _closed || (_items.size() < _capacity);
+        });
+        if(_closed){
+            return;
+        }
+        _items.push_back(item);
+        _notEmpty.notify_one();
+    }
+
+    bool pop(T& item){
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [this](){
+            return _closed || !_items.empty();
+        });
+        if(_items.empty()){
+            return false;
+        }
+        item = _items.front();
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+};
+
+#endif
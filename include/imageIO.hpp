@@ -2,139 +2,480 @@
 #define IMAGE_IO_HPP
 
 #include <vector>
+#include <algorithm>
 
 namespace ImageIO {
-    std::vector<ColourSpaces::RGB> readImageRGB(const char* filename, int& width, int& height){
-        FILE* fp = nullptr;
-        errno_t err;
-        fp = fopen(filename, "rb");
-        if (!fp) {
-            throw std::runtime_error("File \"" + std::string(filename) + "\" could not be found");
-        }
-        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        png_infop info = png_create_info_struct(png);
-        if(setjmp(png_jmpbuf(png))){
-            throw std::runtime_error("File reading error");
-        }
-        png_init_io(png, fp);
-        png_read_info(png, info);
-        width = png_get_image_width(png, info);
-        height = png_get_image_height(png, info);
-        png_byte color_type = png_get_color_type(png, info);
-        png_byte bit_depth = png_get_bit_depth(png, info);
-        if(color_type == PNG_COLOR_TYPE_PALETTE){
-            png_set_palette_to_rgb(png);
-        }
-        else if(color_type == PNG_COLOR_TYPE_GRAY){
-            png_set_gray_to_rgb(png);
-        }
-        else if(color_type != PNG_COLOR_TYPE_RGB){
-            throw std::runtime_error("Supports only rgb, gray and palette");
-        }
-        png_read_update_info(png, info);
-        std::vector<ColourSpaces::RGB> rgbData(height * width);
-        for (int y = 0; y < height; y++) {
-            std::vector<png_byte> buffer(width * 3);
-            png_read_row(png, reinterpret_cast<png_bytep>(buffer.data()), NULL);
-            for (int x = 0; x < width; x++) {
-                rgbData[y * width + x].r = buffer[x * 3];
-                rgbData[y * width + x].g = buffer[x * 3 + 1];
-                rgbData[y * width + x].b = buffer[x * 3 + 2];
+    //Size of libpng's compressed data buffer. It is allocated for every image written, so it is kept small and independent of the image
+    const size_t COMPRESSION_BUFFER_SIZE = 64 * 1024;
+
+    //Where PNG data is read from: a file or a buffer in memory. The buffer is not copied and has to outlive the reading
+    class Source{
+    private:
+        std::string _filename;
+        const std::vector<unsigned char>* _bytes = nullptr;
+        size_t _pos = 0;
+        FILE* _fp = nullptr;
+
+        static void _readBytes(png_structp png, png_bytep out, png_size_t length){
+            Source* src = reinterpret_cast<Source*>(png_get_io_ptr(png));
+            if(src->_pos + length > src->_bytes->size()){
+                png_error(png, "Unexpected end of PNG data");
+            }
+            std::copy(src->_bytes->begin() + src->_pos, src->_bytes->begin() + src->_pos + length, out);
+            src->_pos += length;
+        }
+
+    public:
+        Source(const char* filename) : _filename(filename) {}
+        Source(const std::string& filename) : _filename(filename) {}
+        Source(const std::vector<unsigned char>& bytes) : _bytes(&bytes) {}
+
+        void open(){
+            _pos = 0;
+            if(_bytes == nullptr){
+                _fp = fopen(_filename.c_str(), "rb");
+                if (!_fp) {
+                    throw std::runtime_error("File \"" + _filename + "\" could not be found");
+                }
+            }
+        }
+
+        void attach(png_structp png){
+            if(_fp){
+                png_init_io(png, _fp);
+            }
+            else{
+                png_set_read_fn(png, this, &Source::_readBytes);
+            }
+        }
+
+        void close(){
+            if(_fp){
+                fclose(_fp);
+                _fp = nullptr;
+            }
+        }
+    };
+
+    //Where PNG data is written to: a file or a buffer in memory, which is cleared first
+    class Destination{
+    private:
+        std::string _filename;
+        std::vector<unsigned char>* _bytes = nullptr;
+        FILE* _fp = nullptr;
+
+        static void _writeBytes(png_structp png, png_bytep data, png_size_t length){
+            std::vector<unsigned char>* bytes = reinterpret_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+            bytes->insert(bytes->end(), data, data + length);
+        }
+
+        static void _flush(png_structp){}
+
+    public:
+        Destination(const char* filename) : _filename(filename) {}
+        Destination(const std::string& filename) : _filename(filename) {}
+        Destination(std::vector<unsigned char>& bytes) : _bytes(&bytes) {}
+
+        void open(){
+            if(_bytes == nullptr){
+                _fp = fopen(_filename.c_str(), "wb");
+                if (!_fp) {
+                    throw std::runtime_error("File \"" + _filename + "\" could not be made");
+                }
+            }
+            else{
+                _bytes->clear();
+            }
+        }
+
+        void attach(png_structp png){
+            if(_fp){
+                png_init_io(png, _fp);
+            }
+            else{
+                png_set_write_fn(png, _bytes, &Destination::_writeBytes, &Destination::_flush);
+            }
+        }
+
+        void close(){
+            if(_fp){
+                fclose(_fp);
+                _fp = nullptr;
+            }
+        }
+    };
+
+    //Byte buffers of row readers and writers. Passing the same RowBuffers to every reader or writer
+    //keeps their capacity between images, otherwise each reader or writer allocates its own
+    struct RowBuffers{
+        std::vector<png_byte> row;
+        std::vector<png_byte> prevRow;
+        std::vector<png_byte> filtered;
+        std::vector<png_color> pallete;
+    };
+
+    //Decodes a PNG row by row into RGB
+    class RowReader{
+    private:
+        Source _src;
+        png_structp _png = nullptr;
+        png_infop _info = nullptr;
+        int _width = 0;
+        int _height = 0;
+        RowBuffers _ownBuffers;
+        std::vector<png_byte>& _buffer;
+
+        void _release(){
+            png_destroy_read_struct(&_png, &_info, (png_infopp)NULL);
+            _src.close();
+        }
+
+    public:
+        RowReader(Source src, RowBuffers* buffers = nullptr) : _src(src), _buffer(((buffers)?(buffers):(&_ownBuffers))->row) {
+            _src.open();
+            _png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            _info = png_create_info_struct(_png);
+            if(setjmp(png_jmpbuf(_png))){
+                _release();
+                throw std::runtime_error("File reading error");
+            }
+            _src.attach(_png);
+            png_read_info(_png, _info);
+            _width = png_get_image_width(_png, _info);
+            _height = png_get_image_height(_png, _info);
+            png_byte color_type = png_get_color_type(_png, _info);
+            //Transparency would be expanded into an alpha channel
+            if(png_get_valid(_png, _info, PNG_INFO_tRNS)){
+                _release();
+                throw std::runtime_error("Supports only opaque images");
+            }
+            png_set_strip_16(_png);
+            if(color_type == PNG_COLOR_TYPE_PALETTE){
+                png_set_palette_to_rgb(_png);
+            }
+            else if(color_type == PNG_COLOR_TYPE_GRAY){
+                png_set_gray_to_rgb(_png);
+            }
+            else if(color_type != PNG_COLOR_TYPE_RGB){
+                _release();
+                throw std::runtime_error("Supports only rgb, gray and palette");
+            }
+            png_read_update_info(_png, _info);
+            //Rows are read into a buffer of 8 bit RGB, anything else would overrun it
+            if(png_get_rowbytes(_png, _info) != (size_t)_width * 3){
+                _release();
+                throw std::runtime_error("Unsupported PNG format");
             }
+            _buffer.resize(_width * 3);
         }
-        fclose(fp);
-        if (png && info) {
-            png_destroy_read_struct(&png, &info, (png_infopp)NULL);
+
+        RowReader(const RowReader&) = delete;
+        RowReader& operator=(const RowReader&) = delete;
+
+        ~RowReader(){
+            _release();
+        }
+
+        int width() const {
+            return _width;
+        }
+
+        int height() const {
+            return _height;
+        }
+
+        void readRow(ColourSpaces::RGB* row){
+            if(setjmp(png_jmpbuf(_png))){
+                throw std::runtime_error("File reading error");
+            }
+            png_read_row(_png, _buffer.data(), NULL);
+            for (int x = 0; x < _width; x++) {
+                row[x].r = _buffer[x * 3];
+                row[x].g = _buffer[x * 3 + 1];
+                row[x].b = _buffer[x * 3 + 2];
+            }
         }
+    };
+
+    //Encodes an RGB PNG row by row. finish() has to be called after the last row
+    class RgbRowWriter{
+    private:
+        Destination _dest;
+        png_structp _png = nullptr;
+        png_infop _info = nullptr;
+        int _width = 0;
+        RowBuffers _ownBuffers;
+        std::vector<png_byte>& _buffer;
+
+        void _release(){
+            png_destroy_write_struct(&_png, &_info);
+            _dest.close();
+        }
+
+    public:
+        RgbRowWriter(Destination dest, const int& width, const int& height, const int& compressionLevel = Z_BEST_COMPRESSION, RowBuffers* buffers = nullptr) : 
+        _dest(dest), 
+        _width(width), 
+        _buffer(((buffers)?(buffers):(&_ownBuffers))->row) {
+            _dest.open();
+            _png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            _info = png_create_info_struct(_png);
+            if(setjmp(png_jmpbuf(_png))){
+                _release();
+                throw std::runtime_error("Png writing error");
+            };
+            _dest.attach(_png);
+            png_set_IHDR(
+                _png,
+                _info,
+                width, height,
+                8,
+                PNG_COLOR_TYPE_RGB,
+                PNG_INTERLACE_NONE,
+                PNG_COMPRESSION_TYPE_BASE,
+                PNG_FILTER_TYPE_BASE
+            );
+            png_set_compression_mem_level(_png, MAX_MEM_LEVEL);
+            png_set_compression_level(_png, compressionLevel);
+            png_set_compression_strategy(_png, Z_DEFAULT_STRATEGY);
+            png_set_compression_window_bits(_png, 15);
+            png_set_compression_buffer_size(_png, COMPRESSION_BUFFER_SIZE);
+            png_write_info(_png, _info);
+            _buffer.resize(width * 3);
+        }
+
+        RgbRowWriter(const RgbRowWriter&) = delete;
+        RgbRowWriter& operator=(const RgbRowWriter&) = delete;
+
+        ~RgbRowWriter(){
+            _release();
+        }
+
+        void writeRow(const ColourSpaces::RGB* row){
+            if(setjmp(png_jmpbuf(_png))){
+                throw std::runtime_error("Png writing error");
+            }
+            for (int x = 0; x < _width; x++) {
+                _buffer[x * 3] = row[x].r;
+                _buffer[x * 3 + 1] = row[x].g;
+                _buffer[x * 3 + 2] = row[x].b;
+            }
+            png_write_row(_png, _buffer.data());
+        }
+
+        void finish(){
+            if(setjmp(png_jmpbuf(_png))){
+                throw std::runtime_error("Png writing error");
+            }
+            png_write_end(_png, NULL);
+            _release();
+        }
+    };
+
+    //Smallest PNG bit depth able to hold every palette index
+    int pltBitDepth(const size_t& palleteSize){
+        if(palleteSize <= 2){
+            return 1;
+        }
+        if(palleteSize <= 4){
+            return 2;
+        }
+        if(palleteSize <= 16){
+            return 4;
+        }
+        return 8;
+    }
+
+    //Maps old palette indexes to positions sorted by luminance, so similar colours get close indexes and filtered rows compress better
+    std::vector<unsigned char> pltLuminanceOrder(const std::vector<ColourSpaces::RGB>& pallete){
+        std::vector<unsigned char> sorted(pallete.size());
+        for(size_t i = 0; i < pallete.size(); i++){
+            sorted[i] = i;
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [&pallete](const unsigned char& ind1, const unsigned char& ind2){
+            const ColourSpaces::RGB& c1 = pallete[ind1];
+            const ColourSpaces::RGB& c2 = pallete[ind2];
+            return (299 * c1.r + 587 * c1.g + 114 * c1.b) < (299 * c2.r + 587 * c2.g + 114 * c2.b);
+        });
+        std::vector<unsigned char> remap(pallete.size());
+        for(size_t i = 0; i < sorted.size(); i++){
+            remap[sorted[i]] = i;
+        }
+        return remap;
+    }
+
+    //Estimated compressed size of a row in bits, by order 0 entropy of its bytes
+    double pltRowEntropy(const std::vector<png_byte>& row){
+        size_t histogram[256] = {};
+        for(const png_byte& val : row){
+            histogram[val]++;
+        }
+        double bits = 0;
+        for(const size_t& count : histogram){
+            if(count > 0){
+                bits += count * log2((double)row.size() / count);
+            }
+        }
+        return bits;
+    }
+
+    //Picks the filter of a packed index row. Index values are not magnitudes, so instead of libpng's sum of absolute differences
+    //the candidates are compared by byte entropy. Deflate already matches repeated dither patterns of unfiltered rows,
+    //so a filter has to halve the estimate to be chosen
+    int pltRowFilter(const std::vector<png_byte>& row, const std::vector<png_byte>& prevRow, std::vector<png_byte>& filtered){
+        int filter = PNG_FILTER_NONE;
+        double bestBits = pltRowEntropy(row);
+        filtered[0] = row[0];
+        for(size_t i = 1; i < row.size(); i++){
+            filtered[i] = row[i] - row[i - 1];
+        }
+        double bits = pltRowEntropy(filtered);
+        if(bits < bestBits * 0.5){
+            filter = PNG_FILTER_SUB;
+            bestBits = bits;
+        }
+        for(size_t i = 0; i < row.size(); i++){
+            filtered[i] = row[i] - prevRow[i];
+        }
+        bits = pltRowEntropy(filtered);
+        if(bits < bestBits * 0.5){
+            filter = PNG_FILTER_UP;
+        }
+        return filter;
+    }
+
+    //Encodes a palette PNG row by row with minimal bit depth and luminance ordered palette. finish() has to be called after the last row
+    class PltRowWriter{
+    private:
+        Destination _dest;
+        png_structp _png = nullptr;
+        png_infop _info = nullptr;
+        int _width = 0;
+        int _bitDepth = 8;
+        int _row = 0;
+        std::vector<unsigned char> _remap;
+        RowBuffers _ownBuffers;
+        RowBuffers& _buffers;
+
+        void _release(){
+            png_destroy_write_struct(&_png, &_info);
+            _dest.close();
+        }
+
+    public:
+        PltRowWriter(Destination dest, const std::vector<ColourSpaces::RGB>& pallete, const int& width, const int& height, const int& compressionLevel = Z_BEST_COMPRESSION, RowBuffers* buffers = nullptr) : 
+        _dest(dest), 
+        _width(width), 
+        _buffers((buffers)?(*buffers):(_ownBuffers)) {
+            _remap = pltLuminanceOrder(pallete);
+            _bitDepth = pltBitDepth(pallete.size());
+            std::vector<png_color>& bytePlt = _buffers.pallete;
+            bytePlt.resize(pallete.size());
+            for(int i = 0; i < pallete.size(); i++){
+                bytePlt[_remap[i]].red = pallete[i].r;
+                bytePlt[_remap[i]].green = pallete[i].g;
+                bytePlt[_remap[i]].blue = pallete[i].b;
+            }
+            _dest.open();
+            _png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            _info = png_create_info_struct(_png);
+            if(setjmp(png_jmpbuf(_png))){
+                _release();
+                throw std::runtime_error("Png writing error");
+            };
+            _dest.attach(_png);
+            png_set_IHDR(
+                _png,
+                _info,
+                width, height,
+                _bitDepth,
+                PNG_COLOR_TYPE_PALETTE,
+                PNG_INTERLACE_NONE,
+                PNG_COMPRESSION_TYPE_BASE,
+                PNG_FILTER_TYPE_BASE
+            );
+            //Every candidate has to be enabled before the first row for libpng to allocate its previous row buffer
+            png_set_filter(_png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE | PNG_FILTER_SUB | PNG_FILTER_UP);
+            png_set_compression_mem_level(_png, MAX_MEM_LEVEL);
+            png_set_compression_level(_png, compressionLevel);
+            png_set_compression_strategy(_png, Z_DEFAULT_STRATEGY);
+            png_set_compression_window_bits(_png, 15);
+            png_set_compression_buffer_size(_png, COMPRESSION_BUFFER_SIZE);
+            png_set_PLTE(_png, _info, bytePlt.data(), pallete.size());
+            png_write_info(_png, _info);
+            int pixelsPerByte = 8 / _bitDepth;
+            _buffers.row.resize((width + pixelsPerByte - 1) / pixelsPerByte);
+            _buffers.prevRow.assign(_buffers.row.size(), 0);
+            _buffers.filtered.resize(_buffers.row.size());
+        }
+
+        PltRowWriter(const PltRowWriter&) = delete;
+        PltRowWriter& operator=(const PltRowWriter&) = delete;
+
+        ~PltRowWriter(){
+            _release();
+        }
+
+        void writeRow(const unsigned char* pltIndexes){
+            if(setjmp(png_jmpbuf(_png))){
+                throw std::runtime_error("Png writing error");
+            }
+            int pixelsPerByte = 8 / _bitDepth;
+            std::vector<png_byte>& buffer = _buffers.row;
+            std::fill(buffer.begin(), buffer.end(), 0);
+            for(int x = 0; x < _width; x++){
+                int shift = 8 - _bitDepth * (x % pixelsPerByte + 1);
+                buffer[x / pixelsPerByte] |= _remap[pltIndexes[x]] << shift;
+            }
+            //libpng sets its row buffers up on the first row, which is therefore left to its own choice
+            if(_row > 0){
+                png_set_filter(_png, PNG_FILTER_TYPE_BASE, pltRowFilter(buffer, _buffers.prevRow, _buffers.filtered));
+            }
+            png_write_row(_png, buffer.data());
+            buffer.swap(_buffers.prevRow);
+            _row++;
+        }
+
+        void finish(){
+            if(setjmp(png_jmpbuf(_png))){
+                throw std::runtime_error("Png writing error");
+            }
+            png_write_end(_png, _info);
+            _release();
+        }
+    };
+
+    //Decodes into rgbData, which keeps its capacity when it is big enough
+    void readImageRGB(Source src, std::vector<ColourSpaces::RGB>& rgbData, int& width, int& height, RowBuffers* buffers = nullptr){
+        RowReader reader(src, buffers);
+        width = reader.width();
+        height = reader.height();
+        rgbData.resize((size_t)height * width);
+        for (int y = 0; y < height; y++) {
+            reader.readRow(&rgbData[(size_t)y * width]);
+        }
+    }
+
+    std::vector<ColourSpaces::RGB> readImageRGB(Source src, int& width, int& height){
+        std::vector<ColourSpaces::RGB> rgbData;
+        readImageRGB(src, rgbData, width, height);
         return rgbData;
     } 
 
-    void writeImageRgb(const char* filename, const std::vector<ColourSpaces::RGB>& rgbData, const int& width, const int& height) {
-        FILE* fp = nullptr;
-        errno_t err;
-        fp = fopen(filename, "wb");
-        if (!fp) {
-            throw std::runtime_error("File \"" + std::string(filename) + "\" could not be made");
-        }
-        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        png_infop info = png_create_info_struct(png);
-        if(setjmp(png_jmpbuf(png))){
-            throw std::runtime_error("Png writing error");
-        };
-        png_init_io(png, fp);
-        png_set_IHDR(
-            png,
-            info,
-            width, height,
-            8,
-            PNG_COLOR_TYPE_RGB,
-            PNG_INTERLACE_NONE,
-            PNG_COMPRESSION_TYPE_BASE,
-            PNG_FILTER_TYPE_BASE
-        );
-        png_set_compression_mem_level(png, MAX_MEM_LEVEL);
-        png_set_compression_level(png, Z_BEST_COMPRESSION);
-        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
-        png_set_compression_window_bits(png, 15);
-        png_set_compression_buffer_size(png, rgbData.size()*3);
-        png_write_info(png, info);
+    void writeImageRgb(Destination dest, const std::vector<ColourSpaces::RGB>& rgbData, const int& width, const int& height, const int& compressionLevel = Z_BEST_COMPRESSION, RowBuffers* buffers = nullptr) {
+        RgbRowWriter writer(dest, width, height, compressionLevel, buffers);
         for (int y = 0; y < height; y++) {
-            std::vector<png_byte> buffer(width * 3);
-            for (int x = 0; x < width; x++) {
-                buffer[x * 3] = rgbData[y * width + x].r;
-                buffer[x * 3 + 1] = rgbData[y * width + x].g;
-                buffer[x * 3 + 2] = rgbData[y * width + x].b;
-            }
-            png_write_row(png, buffer.data());   
-        }
-        png_write_end(png, NULL);
-        fclose(fp);
-        if (png && info) {
-            png_destroy_read_struct(&png, &info, (png_infopp)NULL);
+            writer.writeRow(&rgbData[y * width]);
         }
+        writer.finish();
     }
 
-    void writeImagePLT(const char* filename, const std::vector<unsigned char>& pltIndexes, const std::vector<ColourSpaces::RGB>& pallete, const int& width, const int& height){
-        png_colorp bytePlt = new png_color[pallete.size()];
-        for(int i = 0; i < pallete.size(); i++){
-            bytePlt[i].red = pallete[i].r;
-            bytePlt[i].green = pallete[i].g;
-            bytePlt[i].blue = pallete[i].b;
-        }
-        FILE* fp = nullptr;
-        errno_t err;
-        fp = fopen(filename, "wb");
-        if (!fp) {
-            throw std::runtime_error("File \"" + std::string(filename) + "\" could not be made");
-        }
-        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        png_infop info = png_create_info_struct(png);
-        if(setjmp(png_jmpbuf(png))){
-            throw std::runtime_error("Png writing error");
-        };
-        png_init_io(png, fp);
-        png_set_IHDR(
-            png,
-            info,
-            width, height,
-            8,
-            PNG_COLOR_TYPE_PALETTE,
-            PNG_INTERLACE_NONE,
-            PNG_COMPRESSION_TYPE_BASE,
-            PNG_FILTER_TYPE_BASE
-        );
-        png_set_compression_mem_level(png, MAX_MEM_LEVEL);
-        png_set_compression_level(png, Z_BEST_COMPRESSION);
-        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
-        png_set_compression_window_bits(png, 15);
-        png_set_compression_buffer_size(png, pltIndexes.size());
-        png_set_PLTE(png, info, bytePlt, pallete.size());
-        png_write_info(png, info);
+    void writeImagePLT(Destination dest, const std::vector<unsigned char>& pltIndexes, const std::vector<ColourSpaces::RGB>& pallete, const int& width, const int& height, const int& compressionLevel = Z_BEST_COMPRESSION, RowBuffers* buffers = nullptr){
+        PltRowWriter writer(dest, pallete, width, height, compressionLevel, buffers);
         for(int y = 0; y < height; y++){
-            png_write_row(png, &pltIndexes[y * width]);
+            writer.writeRow(&pltIndexes[y * width]);
         }
-        png_write_end(png, info);
-        delete bytePlt;
+        writer.finish();
     }
 }
 
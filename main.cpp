@@ -6,12 +6,17 @@ extern "C"
 #include <cstdio>
 #include "include/ColourCmprs.hpp"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define CHROMINI_DAEMON
+#include "include/Daemon.hpp"
+#endif
+
 using namespace std;
 
 void showHelp(){
     cout 
         << "Help:" << endl
-        << "chromini <max_colors> <learning_portion> <difference_threshold> <sameness_threshold> <learning_rate> <input> <output>" << endl
+        << "chromini <max_colors> <learning_portion> <difference_threshold> <sameness_threshold> <learning_rate> <input> <output> [--time-budget <milliseconds>] [--pipeline] [--kernel <fs|sierra-lite|atkinson|jjn>] [--search <full|orchard>] [--tiles <size>] [--tile-palette <shared|local>] [--cache-bits <bits>]" << endl
         << "ONLY OPAQUE PNG FILES ARE SUPPORTED" << endl
         << "max_colors - maximum amount of colours ([1; 256] as PLT; >256 for SRGB)" << endl
         << "learning_portion - percent of the image to learn from [1; 100]" << endl
@@ -19,7 +24,20 @@ void showHelp(){
         << "sameness_threshold - sameness threshold percentage. Specifies how different two colours should be to be considered same for removal [1; 100]" << endl
         << "learning_rate - colour learning rate [0; 1]" << endl
         << "input - path to input file" << endl
-        << "output - path to output file";
+        << "output - path to output file" << endl
+        << "--time-budget - finish within given milliseconds by reducing training sample, search precision, compression and dithering" << endl
+        << "--pipeline - overlap decoding with training and dithering with encoding" << endl
+        << "--kernel - error diffusion kernel: Floyd-Steinberg, Sierra Lite, Atkinson or Jarvis-Judice-Ninke (default)" << endl
+        << "--search - nearest colour search: full palette scan (default) or seeded from the previous pixel's colour" << endl
+        << "--tiles - dither square tiles of given size [16; ...] in parallel" << endl
+        << "--tile-palette - tiles share one palette (default) or train their own, which gives RGB output" << endl
+        << "--cache-bits - memoise nearest colours by linear RGB quantised to given bits per channel [1; 21]" << endl
+#ifdef CHROMINI_DAEMON
+        << "chromini --daemon [--socket <path>] [--workers <count>]" << endl
+        << "--daemon - serve jobs framed on stdin, or on a Unix domain socket with --socket. Protocol is described in include/Daemon.hpp" << endl
+        << "--workers - amount of worker threads, hardware concurrency by default"
+#endif
+        ;
 }
 
 int main(int argc, char* argv[])
@@ -29,40 +47,151 @@ int main(int argc, char* argv[])
     double diffPercentage = 50;
     double samenessPercentage = 50;
     double learningRate = 0.0001;
-    if(argc != 8){
+    int timeBudget = 0;
+    bool pipelined = false;
+    DiffusionKernels::Kernel kernel = DiffusionKernels::JarvisJudiceNinke;
+    bool seededSearch = false;
+    int tileSize = 0;
+    bool localPalettes = false;
+    int cacheBits = 0;
+    bool daemonMode = false;
+    string socketPath;
+    int workers = thread::hardware_concurrency();
+    vector<char*> args;
+    for(int i = 1; i < argc; i++){
+        if(string(argv[i]) == "--pipeline"){
+            pipelined = true;
+        }
+        else if(string(argv[i]) == "--kernel"){
+            if((i + 1 == argc) || !DiffusionKernels::fromName(argv[++i], kernel)){
+                showHelp();
+                return 0;
+            }
+        }
+        else if(string(argv[i]) == "--search"){
+            if((i + 1 == argc) || ((string(argv[i + 1]) != "full") && (string(argv[i + 1]) != "orchard"))){
+                showHelp();
+                return 0;
+            }
+            seededSearch = (string(argv[++i]) == "orchard");
+        }
+        else if(string(argv[i]) == "--tiles"){
+            if(i + 1 == argc){
+                showHelp();
+                return 0;
+            }
+            tileSize = atoi(argv[++i]);
+            if(tileSize < 16){
+                showHelp();
+                return 0;
+            }
+        }
+        else if(string(argv[i]) == "--tile-palette"){
+            if((i + 1 == argc) || ((string(argv[i + 1]) != "shared") && (string(argv[i + 1]) != "local"))){
+                showHelp();
+                return 0;
+            }
+            localPalettes = (string(argv[++i]) == "local");
+        }
+        else if(string(argv[i]) == "--cache-bits"){
+            if(i + 1 == argc){
+                showHelp();
+                return 0;
+            }
+            cacheBits = atoi(argv[++i]);
+            if((cacheBits < 1) || (cacheBits > 21)){
+                showHelp();
+                return 0;
+            }
+        }
+        else if(string(argv[i]) == "--daemon"){
+            daemonMode = true;
+        }
+        else if((string(argv[i]) == "--socket") && (i + 1 < argc)){
+            daemonMode = true;
+            socketPath = argv[++i];
+        }
+        else if((string(argv[i]) == "--workers") && (i + 1 < argc)){
+            workers = atoi(argv[++i]);
+            if(workers < 1){
+                showHelp();
+                return 0;
+            }
+        }
+        else if(string(argv[i]) == "--time-budget"){
+            if(i + 1 == argc){
+                showHelp();
+                return 0;
+            }
+            timeBudget = atoi(argv[++i]);
+            if(timeBudget < 1){
+                showHelp();
+                return 0;
+            }
+        }
+        else{
+            args.push_back(argv[i]);
+        }
+    }
+#ifdef CHROMINI_DAEMON
+    if(daemonMode){
+        //stdout carries responses in this mode, so errors go to stderr
+        try{
+            Daemon daemon(workers);
+            if(socketPath.empty()){
+                daemon.serveStdio();
+            }
+            else{
+                daemon.serveSocket(socketPath);
+            }
+        }
+        catch(const runtime_error& e){
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+#endif
+    if(daemonMode || (args.size() != 7)){
         showHelp();
         return 0;
     }
     else{
-        numColours = atoi(argv[1]);
+        numColours = atoi(args[0]);
         if(numColours < 1){
             showHelp();
             return 0;
         }
-        learnPercent = atoi(argv[2]);
+        learnPercent = atoi(args[1]);
         if((learnPercent < 0) || (learnPercent > 100)){
             showHelp();
             return 0;
         }
-        diffPercentage = atof(argv[3]);
+        diffPercentage = atof(args[2]);
         if((diffPercentage < 1.0) || (diffPercentage > 100.0)){
             showHelp();
             return 0;
         }
-        samenessPercentage = atof(argv[3]);
+        samenessPercentage = atof(args[3]);
         if((samenessPercentage < 1.0) || (samenessPercentage > 100)){
             showHelp();
             return 0;
         }
-        learningRate = atof(argv[5]);
-        if(learningRate <= 0) || (learningRate > 1){
+        learningRate = atof(args[4]);
+        if((learningRate <= 0) || (learningRate > 1)){
             showHelp();
             return 0;
         }
     }
     ColourCmprs imgCmprs(numColours, diffPercentage, samenessPercentage, learnPercent, learningRate);
+    imgCmprs.setTimeBudget(timeBudget);
+    imgCmprs.setPipelined(pipelined);
+    imgCmprs.setKernel(kernel);
+    imgCmprs.setSeededSearch(seededSearch);
+    imgCmprs.setTiles(tileSize, localPalettes);
+    imgCmprs.setCacheBits(cacheBits);
     try{
-        imgCmprs.process(argv[6], argv[7], true);
+        imgCmprs.process(args[5], args[6], true);
     }
     catch(const runtime_error& e){
         cout 